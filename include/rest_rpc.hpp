@@ -1,2 +1,4 @@
+#include "rest_rpc/balanced_client.hpp"
 #include "rest_rpc/rpc_client.hpp"
+#include "rest_rpc/rpc_client_pool.hpp"
 #include "rest_rpc/rpc_server.hpp"
\ No newline at end of file
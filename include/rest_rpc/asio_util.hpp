@@ -18,6 +18,36 @@ template <typename T> struct return_type<T, true> {
 
 template <typename T> using return_type_t = typename return_type<T>::type;
 
+// one-shot notification, the waiter and the notifier must run in the same
+// executor.
+class wait_event {
+public:
+  template <typename Self> void operator()(Self &&self) {
+    using SelfType = std::decay_t<Self>;
+    auto shared_self = std::make_shared<SelfType>(std::move(self));
+
+    complete_handler_ = [shared_self]() mutable { shared_self->complete(); };
+  }
+
+  asio::awaitable<void> wait() {
+    co_await asio::async_compose<decltype(asio::use_awaitable), void()>(
+        std::ref(*this), asio::use_awaitable);
+  }
+
+  auto take_handler() { return std::exchange(complete_handler_, nullptr); }
+
+  bool waiting() const { return complete_handler_ != nullptr; }
+
+  void notify() {
+    if (auto handler = take_handler()) {
+      handler();
+    }
+  }
+
+private:
+  std::function<void()> complete_handler_;
+};
+
 template <typename Coro> inline auto async_start(auto executor, Coro &&coro) {
   asio::co_spawn(executor, std::forward<Coro>(coro), asio::detached);
 }
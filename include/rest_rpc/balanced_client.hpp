@@ -0,0 +1,400 @@
+#pragma once
+#include "rpc_client.hpp"
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <random>
+#include <vector>
+
+namespace rest_rpc {
+enum class balance_policy {
+  round_robin,
+  // the endpoint with the fewest calls in flight.
+  least_outstanding,
+  // the better of two random endpoints, scored by the observed latency and
+  // the calls in flight.
+  power_of_two,
+};
+
+// A client of the replicas of a service, it keeps one multiplexed connection
+// per endpoint and spreads the calls among them by the policy. All the calls
+// must be made on the executor of the client, the closed endpoints are
+// skipped.
+class balanced_client {
+public:
+  explicit balanced_client(
+      balance_policy policy = balance_policy::round_robin,
+      asio::any_io_executor executor = get_global_executor())
+      : policy_(policy), executor_(std::move(executor)) {}
+
+  auto get_executor() { return executor_; }
+
+  // connect all the endpoints, "host:port" each, it fails if none of them
+  // can be connected.
+  asio::awaitable<std::error_code> connect(
+      const std::vector<std::string> &addresses,
+      std::chrono::steady_clock::duration duration = std::chrono::seconds(5)) {
+    std::error_code ec = make_error_code(rpc_errc::no_such_key);
+    for (auto &address : addresses) {
+      if (auto r = co_await add_endpoint(duration, address)) {
+        ec = r;
+      }
+    }
+    co_return endpoints_.empty() ? ec : std::error_code{};
+  }
+
+  // connect all the resolved addresses of the host, the address and the
+  // port are passed apart, an IPv6 address contains ':'.
+  asio::awaitable<std::error_code> connect(
+      std::string_view host, std::string_view port,
+      std::chrono::steady_clock::duration duration = std::chrono::seconds(5)) {
+    asio::ip::tcp::resolver resolver(executor_);
+    auto [ec, results] = co_await resolver.async_resolve(
+        host, port, asio::as_tuple(asio::use_awaitable));
+    if (ec) {
+      co_return ec;
+    }
+    ec = make_error_code(rpc_errc::no_such_key);
+    for (auto &entry : results) {
+      auto endpoint = entry.endpoint();
+      if (auto r = co_await add_endpoint(duration,
+                                         endpoint.address().to_string(),
+                                         std::to_string(endpoint.port()))) {
+        ec = r;
+      }
+    }
+    co_return endpoints_.empty() ? ec : std::error_code{};
+  }
+
+  template <auto func, typename... Args>
+  asio::awaitable<
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  call(Args &&...args) {
+    return call_for<func>(std::chrono::seconds(5), std::forward<Args>(args)...);
+  }
+
+  template <auto func, typename... Args>
+  asio::awaitable<
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  call_for(auto duration, Args &&...args) {
+    auto ep = pick();
+    if (ep == nullptr) {
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>
+          result{};
+      result.ec = rpc_errc::socket_closed;
+      co_return result;
+    }
+
+    ep->outstanding++;
+    auto start = std::chrono::steady_clock::now();
+    auto result = co_await ep->client->template call_for<func>(
+        duration, std::forward<Args>(args)...);
+    ep->outstanding--;
+    observe(*ep, *stats_, result.ec, std::chrono::steady_clock::now() - start,
+            duration);
+    co_return result;
+  }
+
+  // Hedged calls are only for the idempotent handlers. If no reply arrives
+  // within the given percentile of the observed latencies, the request is
+  // sent again to another endpoint and the first reply is taken, the other
+  // one is cancelled. The percentile is clamped to [0, 1], min_delay is the
+  // lower bound of the delay, and the delay before enough latencies have
+  // been observed.
+  void set_hedge_policy(double percentile,
+                        std::chrono::steady_clock::duration min_delay) {
+    stats_->percentile = !(percentile > 0) ? 0 : (std::min)(percentile, 1.0);
+    min_hedge_delay_ = min_delay;
+  }
+
+  template <auto func, typename... Args>
+  asio::awaitable<
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  hedged_call(Args &&...args) {
+    return hedged_call_for<func>(std::chrono::seconds(5),
+                                 std::forward<Args>(args)...);
+  }
+
+  template <auto func, typename... Args>
+  asio::awaitable<
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  hedged_call_for(auto duration, Args &&...args) {
+    using R = return_type_t<function_return_type_t<decltype(func)>>;
+    auto primary = pick();
+    if (primary == nullptr) {
+      call_result<R> result{};
+      result.ec = rpc_errc::socket_closed;
+      co_return result;
+    }
+
+    // the args are kept by the race, the later attempt may outlive the
+    // caller.
+    using args_tuple = function_parameters_t<decltype(func)>;
+    auto race = std::make_shared<hedge_race<R, args_tuple>>(
+        executor_, std::forward<Args>(args)...);
+    race->timer.expires_after(hedge_delay());
+    // an attempt is pending from the moment it is spawned, so a failure
+    // doesn't win over an attempt which hasn't started yet.
+    race->pending++;
+    asio::co_spawn(executor_, attempt<func>(stats_, race, primary, duration),
+                   asio::detached);
+    co_await race->timer.async_wait(asio::as_tuple(asio::use_awaitable));
+    if (!race->result) {
+      if (auto backup = pick_other(primary)) {
+        hedged_++;
+        race->pending++;
+        asio::co_spawn(executor_,
+                       attempt<func>(stats_, race, backup, duration),
+                       asio::detached);
+      }
+      while (!race->result) {
+        race->timer.expires_at(std::chrono::steady_clock::time_point::max());
+        co_await race->timer.async_wait(asio::as_tuple(asio::use_awaitable));
+      }
+    }
+    co_return std::move(*race->result);
+  }
+
+  // the number of the requests sent again by the hedged calls.
+  uint64_t hedged_requests() const { return hedged_; }
+
+  size_t size() const { return endpoints_.size(); }
+
+  // the calls in flight of the endpoint.
+  size_t outstanding(size_t index) const {
+    return endpoints_[index]->outstanding;
+  }
+
+  // the moving average latency of the endpoint, in microseconds.
+  double latency(size_t index) const { return endpoints_[index]->latency; }
+
+  void close() {
+    for (auto &ep : endpoints_) {
+      ep->client->close();
+    }
+  }
+
+private:
+  struct endpoint {
+    explicit endpoint(std::unique_ptr<rpc_client> c) : client(std::move(c)) {}
+
+    void observe(std::chrono::steady_clock::duration dur) {
+      double us = std::chrono::duration<double, std::micro>(dur).count();
+      latency = latency == 0 ? us : latency * (1 - decay) + us * decay;
+    }
+
+    // the latency weighted by the load, an endpoint not yet measured is
+    // tried first.
+    double score() const { return latency * (outstanding + 1); }
+
+    inline static constexpr double decay = 0.2;
+
+    std::unique_ptr<rpc_client> client;
+    size_t outstanding = 0;
+    double latency = 0;
+  };
+
+  template <typename R, typename ArgsTuple> struct hedge_race {
+    template <typename... Ts>
+    hedge_race(asio::any_io_executor executor, Ts &&...ts)
+        : timer(executor), args(std::forward<Ts>(ts)...) {}
+
+    // the timer is cancelled when the race is done.
+    asio::steady_timer timer;
+    ArgsTuple args;
+    std::optional<call_result<R>> result;
+    size_t pending = 0;
+    std::vector<std::shared_ptr<call_canceller>> cancellers;
+  };
+
+  // The recent latencies of all the endpoints, for the hedge delay. They are
+  // shared with the hedged attempts, a loser may outlive the balancer.
+  struct latency_stats {
+    void observe(std::chrono::steady_clock::duration dur) {
+      samples[count++ % samples.size()] = dur;
+      if (count % 16 == 0) {
+        // refresh the percentile of the recent latencies.
+        size_t n = (std::min)(count, samples.size());
+        sorted.assign(samples.begin(), samples.begin() + n);
+        auto nth = sorted.begin() + size_t(percentile * (n - 1));
+        std::nth_element(sorted.begin(), nth, sorted.end());
+        percentile_latency = *nth;
+      }
+    }
+
+    std::array<std::chrono::steady_clock::duration, 256> samples{};
+    size_t count = 0;
+    std::vector<std::chrono::steady_clock::duration> sorted;
+    std::chrono::steady_clock::duration percentile_latency{};
+    double percentile = 0.95;
+  };
+
+  // The first successful reply wins and the other attempts are cancelled, a
+  // failure only wins if no other attempt is pending. Only the completed
+  // attempts are recorded in the latency window. The time a cancelled loser
+  // has taken only raises the latency of its endpoint, so an endpoint which
+  // always loses is not taken as unmeasured.
+  template <auto func, typename Race>
+  static asio::awaitable<void> attempt(std::shared_ptr<latency_stats> stats,
+                                       std::shared_ptr<Race> race,
+                                       std::shared_ptr<endpoint> ep,
+                                       auto duration) {
+    if (race->result) {
+      // the race was done before it started.
+      race->pending--;
+      co_return;
+    }
+    ep->outstanding++;
+    auto canceller = std::make_shared<call_canceller>();
+    race->cancellers.push_back(canceller);
+    auto start = std::chrono::steady_clock::now();
+    auto result = co_await std::apply(
+        [&](auto &...args) {
+          return ep->client->template cancellable_call_for<func>(
+              *canceller, duration, args...);
+        },
+        race->args);
+    ep->outstanding--;
+    race->pending--;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (result.ec == rpc_errc::request_cancelled) {
+      auto us = std::chrono::duration<double, std::micro>(elapsed).count();
+      if (ep->latency < us) {
+        ep->observe(elapsed);
+      }
+      co_return;
+    }
+    observe(*ep, *stats, result.ec, elapsed, duration);
+    if (race->result || (result.ec != rpc_errc::ok && race->pending > 0)) {
+      co_return;
+    }
+    race->result = std::move(result);
+    for (auto &other : race->cancellers) {
+      other->cancel();
+    }
+    race->timer.cancel();
+  }
+
+  // the args are the address of rpc_client::connect.
+  template <typename... Address>
+  asio::awaitable<std::error_code>
+  add_endpoint(std::chrono::steady_clock::duration duration,
+               const Address &...address) {
+    auto client = std::make_unique<rpc_client>(executor_);
+    client->enable_multiplexing(true);
+    auto ec = co_await client->connect(address..., duration);
+    if (ec) {
+      std::string name;
+      ((name.append(name.empty() ? "" : " ").append(address)), ...);
+      REST_LOG_WARNING << "connect " << name << " failed: " << ec.message();
+      co_return ec;
+    }
+    endpoints_.push_back(std::make_shared<endpoint>(std::move(client)));
+    co_return ec;
+  }
+
+  // the endpoint failed rather than the handler, such a call is observed as
+  // a timeout, so the failing endpoint is avoided.
+  static bool endpoint_failed(rpc_errc ec) {
+    switch (ec) {
+    case rpc_errc::write_error:
+    case rpc_errc::read_error:
+    case rpc_errc::socket_closed:
+    case rpc_errc::request_timeout:
+    case rpc_errc::protocol_error:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static void observe(endpoint &ep, latency_stats &stats, rpc_errc ec,
+                      std::chrono::steady_clock::duration elapsed,
+                      auto timeout) {
+    if (endpoint_failed(ec)) {
+      elapsed = (std::max)(
+          elapsed,
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              timeout));
+    }
+    ep.observe(elapsed);
+    stats.observe(elapsed);
+  }
+
+  std::chrono::steady_clock::duration hedge_delay() const {
+    return (std::max)(stats_->percentile_latency, min_hedge_delay_);
+  }
+
+  std::shared_ptr<endpoint> pick_other(const std::shared_ptr<endpoint> &ep) {
+    for (size_t i = 0; i < endpoints_.size(); i++) {
+      auto &other = endpoints_[(next_ + i) % endpoints_.size()];
+      if (other != ep && !other->client->has_closed()) {
+        return other;
+      }
+    }
+    return nullptr;
+  }
+
+  std::shared_ptr<endpoint> pick() {
+    size_t n = endpoints_.size();
+    if (n == 0) {
+      return nullptr;
+    }
+
+    std::shared_ptr<endpoint> best;
+    switch (policy_) {
+    case balance_policy::round_robin:
+      for (size_t i = 0; i < n; i++) {
+        auto &ep = endpoints_[next_++ % n];
+        if (!ep->client->has_closed()) {
+          return ep;
+        }
+      }
+      return nullptr;
+    case balance_policy::least_outstanding:
+      for (size_t i = 0; i < n; i++) {
+        // start from the next one, so the ties are spread.
+        auto &ep = endpoints_[(next_ + i) % n];
+        if (!ep->client->has_closed() &&
+            (best == nullptr || ep->outstanding < best->outstanding)) {
+          best = ep;
+        }
+      }
+      next_++;
+      return best;
+    case balance_policy::power_of_two: {
+      size_t i = rand_() % n;
+      size_t j = n > 1 ? (i + 1 + rand_() % (n - 1)) % n : i;
+      for (auto &ep : {endpoints_[i], endpoints_[j]}) {
+        if (!ep->client->has_closed() &&
+            (best == nullptr || ep->score() < best->score())) {
+          best = ep;
+        }
+      }
+      if (best == nullptr) {
+        // both are closed, fall back to any open one.
+        for (auto &ep : endpoints_) {
+          if (!ep->client->has_closed()) {
+            return ep;
+          }
+        }
+      }
+      return best;
+    }
+    }
+    return nullptr;
+  }
+
+  balance_policy policy_;
+  asio::any_io_executor executor_;
+  // shared with the hedged attempts, a loser may outlive the balancer.
+  std::vector<std::shared_ptr<endpoint>> endpoints_;
+  size_t next_ = 0;
+  std::minstd_rand rand_{std::random_device{}()};
+
+  std::shared_ptr<latency_stats> stats_ = std::make_shared<latency_stats>();
+  std::chrono::steady_clock::duration min_hedge_delay_ =
+      std::chrono::milliseconds(1);
+  uint64_t hedged_ = 0;
+};
+} // namespace rest_rpc
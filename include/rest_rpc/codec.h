@@ -2,7 +2,10 @@
 #define REST_RPC_CODEC_H_
 
 #include "traits.h"
+#include <algorithm>
+#include <bit>
 #include <charconv>
+#include <cstring>
 #include <ylt/struct_pack.hpp>
 
 namespace user_codec {
@@ -10,6 +13,21 @@ struct rest_adl_tag {};
 } // namespace user_codec
 
 namespace rest_rpc {
+// the serialize_type field of rest_rpc_header, the server decodes the args
+// with the codec chosen by the client and encodes the result with the same
+// one.
+enum class serialize_type : uint8_t {
+  // basic types as text or raw bytes, others by the user codec if it is
+  // defined, otherwise by struct_pack.
+  rest = 0,
+  struct_pack = 1,
+  // arithmetic types as fixed-width little-endian bytes, strings as raw bytes,
+  // others by struct_pack.
+  binary = 2,
+  // the user codec found by ADL in user_codec namespace.
+  user = 3,
+};
+
 namespace detail {
 template <typename T, typename... Args>
 struct has_user_pack : std::false_type {};
@@ -25,64 +43,198 @@ struct has_user_pack<
 template <typename... Args>
 inline constexpr bool has_user_pack_v = has_user_pack<void, Args...>::value;
 
+template <typename T> inline T to_little_endian(T t) {
+  if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+    char *p = reinterpret_cast<char *>(&t);
+    std::reverse(p, p + sizeof(T));
+  }
+  return t;
+}
+
+// char arrays are packed as strings, so they match the string params.
+template <typename T> inline decltype(auto) as_packable(T &&t) {
+  if constexpr (util::CharArrayRef<T> || util::CharArray<T>) {
+    return std::string_view(t);
+  } else {
+    return std::forward<T>(t);
+  }
+}
+
 } // namespace detail
 
+// a fixed-width value packed in place, it needs no heap allocation.
+struct inline_value {
+  static constexpr size_t capacity = 16;
+  char buf[capacity];
+  uint8_t len = 0;
+
+  std::string_view data() const { return std::string_view(buf, len); }
+  size_t size() const { return len; }
+};
+
+// the packed args, the ones packed without copying refer to the caller's data.
+struct packed_args {
+  packed_args() = default;
+  packed_args(std::string str) : buf(std::move(str)) {}
+  packed_args(std::string_view str) : view(str) {}
+  packed_args(const inline_value &val) : small(val) {}
+
+  std::string buf;
+  std::string_view view;
+  inline_value small;
+
+  std::string_view data() const {
+    if (small.len > 0) {
+      return small.data();
+    }
+    return buf.empty() ? view : buf;
+  }
+  size_t size() const { return data().size(); }
+};
+
 struct rpc_codec {
-  template <typename... Args> inline static auto pack_args(Args &&...args) {
+  template <serialize_type Type = serialize_type::rest, typename... Args>
+  inline static auto pack_args(Args &&...args) {
     if constexpr (sizeof...(Args) == 0) {
       return std::string_view{};
+    } else if constexpr (Type == serialize_type::struct_pack) {
+      return struct_pack_args(std::forward<Args>(args)...);
+    } else if constexpr (Type == serialize_type::user) {
+      if constexpr (detail::has_user_pack_v<Args...>) {
+        return serialize(user_codec::rest_adl_tag{},
+                         std::forward<Args>(args)...);
+      } else {
+        throw std::invalid_argument("pack failed: no user codec");
+        return std::string{};
+      }
     } else if constexpr (sizeof...(Args) == 1 && util::is_basic_v<Args...>) {
-      return pack_one(std::forward<Args>(args)...);
+      return pack_one<Type>(std::forward<Args>(args)...);
+    } else if constexpr (Type == serialize_type::binary) {
+      return struct_pack_args(std::forward<Args>(args)...);
     } else {
       if constexpr (detail::has_user_pack_v<Args...>) {
         return serialize(user_codec::rest_adl_tag{},
                          std::forward<Args>(args)...);
       } else {
-        if constexpr (sizeof...(Args) > 1) {
-          return struct_pack::serialize<std::string>(std::forward_as_tuple(std::forward<Args>(args)...));              
-        } else {
-          return struct_pack::serialize<std::string>(std::forward<Args>(args)...);
-        }
+        return struct_pack_args(std::forward<Args>(args)...);
       }
     }
   }
 
-  template <typename T> inline static T unpack(std::string_view data) {
-    if constexpr (std::is_fundamental_v<T>) {
+  template <typename T, serialize_type Type = serialize_type::rest>
+  inline static T unpack(std::string_view data) {
+    if constexpr (Type == serialize_type::struct_pack) {
+      return struct_pack_unpack<T>(data);
+    } else if constexpr (Type == serialize_type::user) {
+      if constexpr (detail::has_user_pack_v<T>) {
+        return deserialize<T>(user_codec::rest_adl_tag{}, data);
+      } else {
+        throw std::invalid_argument("unpack failed: no user codec");
+      }
+    } else if constexpr (std::is_fundamental_v<T>) {
       T t;
-      auto r = std::from_chars(data.data(), data.data() + data.size(), t);
-      if (r.ec != std::errc()) {
-        throw std::invalid_argument("unpack failed: Args not match!");
+      if constexpr (Type == serialize_type::binary) {
+        if (data.size() != sizeof(T)) {
+          throw std::invalid_argument("unpack failed: Args not match!");
+        }
+        std::memcpy(&t, data.data(), sizeof(T));
+        return detail::to_little_endian(t);
+      } else {
+        auto r = std::from_chars(data.data(), data.data() + data.size(), t);
+        if (r.ec != std::errc()) {
+          throw std::invalid_argument("unpack failed: Args not match!");
+        }
+        return t;
       }
-      return t;
     } else if constexpr (std::is_same_v<std::string, T>) {
       return std::string(data);
     } else if constexpr (std::is_same_v<std::string_view, T>) {
       return data;
+    } else if constexpr (Type == serialize_type::binary) {
+      return struct_pack_unpack<T>(data);
     } else {
       if constexpr (detail::has_user_pack_v<T>) {
         return deserialize<T>(user_codec::rest_adl_tag{}, data);
       } else {
-        auto r = struct_pack::deserialize<T>(data);
-        if(!r) {
-          throw std::invalid_argument("unpack failed: " + std::string(r.error().message()));
-        }
-        return r.value();
+        return struct_pack_unpack<T>(data);
       }
     }
   }
 
+  // select the codec by the serialize_type field at runtime.
+  template <typename... Args>
+  inline static packed_args pack_as(serialize_type type, Args &&...args) {
+    switch (type) {
+    case serialize_type::rest:
+      return pack_args<serialize_type::rest>(std::forward<Args>(args)...);
+    case serialize_type::struct_pack:
+      return pack_args<serialize_type::struct_pack>(
+          std::forward<Args>(args)...);
+    case serialize_type::binary:
+      return pack_args<serialize_type::binary>(std::forward<Args>(args)...);
+    case serialize_type::user:
+      return pack_args<serialize_type::user>(std::forward<Args>(args)...);
+    default:
+      throw std::invalid_argument("unknown serialize type");
+    }
+  }
+
+  template <typename T>
+  inline static T unpack_as(serialize_type type, std::string_view data) {
+    switch (type) {
+    case serialize_type::rest:
+      return unpack<T, serialize_type::rest>(data);
+    case serialize_type::struct_pack:
+      return unpack<T, serialize_type::struct_pack>(data);
+    case serialize_type::binary:
+      return unpack<T, serialize_type::binary>(data);
+    case serialize_type::user:
+      return unpack<T, serialize_type::user>(data);
+    default:
+      throw std::invalid_argument("unknown serialize type");
+    }
+  }
+
 private:
-  template <typename Arg> inline static auto pack_one(Arg &&arg) {
+  template <serialize_type Type, typename Arg>
+  inline static auto pack_one(Arg &&arg) {
     if constexpr (util::CharArrayRef<Arg> || util::CharArray<Arg> ||
                   util::string<Arg>) {
       return std::string_view(std::forward<Arg>(arg));
+    } else if constexpr (Type == serialize_type::binary) {
+      static_assert(sizeof(arg) <= inline_value::capacity);
+      auto t = detail::to_little_endian(arg);
+      inline_value val;
+      std::memcpy(val.buf, &t, sizeof(t));
+      val.len = sizeof(t);
+      return val;
     } else {
       return std::to_string(arg);
     }
   }
+
+  template <typename... Args>
+  inline static std::string struct_pack_args(Args &&...args) {
+    if constexpr (sizeof...(Args) > 1) {
+      return struct_pack::serialize<std::string>(std::forward_as_tuple(
+          detail::as_packable(std::forward<Args>(args))...));
+    } else {
+      return struct_pack::serialize<std::string>(
+          detail::as_packable(std::forward<Args>(args))...);
+    }
+  }
+
+  template <typename T>
+  inline static T struct_pack_unpack(std::string_view data) {
+    auto r = struct_pack::deserialize<T>(data);
+    if (!r) {
+      throw std::invalid_argument("unpack failed: " +
+                                  std::string(r.error().message()));
+    }
+    return r.value();
+  }
 };
 
 } // namespace rest_rpc
 
-#endif // REST_RPC_CODEC_H_
\ No newline at end of file
+#endif // REST_RPC_CODEC_H_
@@ -21,6 +21,8 @@ enum class rpc_errc : std::int8_t {
   has_response,
   duplicate_topic,
   rpc_context_init_failed,
+  unsubscribed,
+  request_cancelled,
 };
 
 class rpc_error_category : public std::error_category {
@@ -64,6 +66,10 @@ public:
     case rpc_errc::rpc_context_init_failed:
       return "the rpc context init failed, it must be created in rpc handler "
              "io thread, otherwise will init failed";
+    case rpc_errc::unsubscribed:
+      return "the topic is unsubscribed";
+    case rpc_errc::request_cancelled:
+      return "request cancelled";
     default:
       return "unknown error";
     }
@@ -1,8 +1,55 @@
 #pragma once
-#include <asio.hpp>
+#include "logger.hpp"
+#include "use_asio.hpp"
 #include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
 
 namespace rest_rpc {
+namespace detail {
+// bind the calling thread to the cpu core, false for a core out of range.
+inline bool bind_to_cpu(int core) {
+  if (core < 0) {
+    return false;
+  }
+#if defined(__linux__)
+  if (core >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+  if (core >= int(sizeof(DWORD_PTR) * 8)) {
+    return false;
+  }
+  return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core) != 0;
+#else
+  (void)core;
+  return false;
+#endif
+}
+} // namespace detail
+
+// how the new connections are placed on the io_contexts.
+enum class placement_policy {
+  round_robin,
+  // the one with the lowest load, its share of the request rate of the last
+  // second plus its share of the live connections.
+  least_loaded,
+};
+
+// the load of an io_context, it is updated by the connections of it.
+struct context_load {
+  std::atomic<size_t> connections = 0;
+  std::atomic<uint64_t> requests = 0;
+};
+
 class io_context_pool {
 public:
   explicit io_context_pool(size_t pool_size) {
@@ -14,7 +61,9 @@ public:
       auto io_ctx = std::make_shared<asio::io_context>();
       works_.push_back(asio::make_work_guard(*io_ctx));
       io_contexts_.emplace_back(io_ctx);
+      loads_.push_back(std::make_shared<context_load>());
     }
+    windows_.resize(pool_size);
   }
 
   ~io_context_pool() { stop(); }
@@ -22,8 +71,8 @@ public:
   void run() {
     std::call_once(run_flag_, [this] {
       std::vector<std::thread> threads;
-      for (auto &ctx : io_contexts_) {
-        threads.push_back(std::thread([&ctx] { ctx->run(); }));
+      for (size_t i = 0; i < io_contexts_.size(); i++) {
+        threads.push_back(std::thread([this, i] { io_contexts_[i]->run(); }));
       }
 
       for (auto &thd : threads) {
@@ -32,6 +81,25 @@ public:
     });
   }
 
+  // Pin the thread of the i-th io_context to cores[i % cores.size()], the
+  // binding runs in that thread before the work queued after it, so it also
+  // works on a running pool. The memory is allocated on the local NUMA node
+  // of the core by first touch, the buffers of a connection are allocated
+  // lazily in its io_context thread, so it is best set before run.
+  void set_cpu_affinity(const std::vector<int> &cores) {
+    if (cores.empty()) {
+      return;
+    }
+    for (size_t i = 0; i < io_contexts_.size(); i++) {
+      int core = cores[i % cores.size()];
+      asio::post(*io_contexts_[i], [core] {
+        if (!detail::bind_to_cpu(core)) {
+          REST_LOG_WARNING << "bind to cpu " << core << " failed";
+        }
+      });
+    }
+  }
+
   void stop() {
     std::call_once(stop_flag_, [this] { works_.clear(); });
   }
@@ -45,12 +113,85 @@ public:
 
   asio::io_context &get_io_context() { return *get_io_context_ptr(); }
 
+  asio::io_context &get_io_context(size_t index) {
+    return *io_contexts_[index % io_contexts_.size()];
+  }
+
   auto get_executor() {
     auto &ctx = get_io_context();
     return ctx.get_executor();
   }
 
+  void set_placement_policy(placement_policy policy) { policy_ = policy; }
+
+  // the index of the io_context for a new connection.
+  size_t place_connection() {
+    if (policy_ == placement_policy::round_robin) {
+      return next_.fetch_add(1, std::memory_order::relaxed) %
+             io_contexts_.size();
+    }
+
+    std::scoped_lock lock(placement_mtx_);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - window_time_).count();
+    bool roll = elapsed >= 1;
+    if (roll) {
+      window_time_ = now;
+    }
+
+    // the rate of the last second, the previous window is blended with the
+    // current one by how much of the second the current one covers.
+    std::vector<double> rates(loads_.size());
+    std::vector<size_t> conns(loads_.size());
+    double total_rate = 0;
+    size_t total_conns = 0;
+    for (size_t i = 0; i < loads_.size(); i++) {
+      auto &window = windows_[i];
+      uint64_t requests = loads_[i]->requests.load(std::memory_order::relaxed);
+      if (roll) {
+        window.rate = (requests - window.start) / elapsed;
+        window.start = requests;
+        rates[i] = window.rate;
+      } else {
+        rates[i] = window.rate * (1 - elapsed) + (requests - window.start);
+      }
+      conns[i] = loads_[i]->connections.load(std::memory_order::relaxed);
+      total_rate += rates[i];
+      total_conns += conns[i];
+    }
+
+    size_t index = 0;
+    double min_load = 0;
+    for (size_t i = 0; i < loads_.size(); i++) {
+      double load = (total_rate > 0 ? rates[i] / total_rate : 0) +
+                    (total_conns > 0 ? double(conns[i]) / total_conns : 0);
+      if (i == 0 || load < min_load) {
+        min_load = load;
+        index = i;
+      }
+    }
+    return index;
+  }
+
+  std::shared_ptr<context_load> get_load(size_t index) const {
+    return loads_[index % loads_.size()];
+  }
+
 private:
+  // the request count at the start of the window and the request rate of
+  // the previous window, only touched by the placement.
+  struct load_window {
+    uint64_t start = 0;
+    double rate = 0;
+  };
+
+  // shared with the connections, they may outlive the pool.
+  std::vector<std::shared_ptr<context_load>> loads_;
+  std::vector<load_window> windows_;
+  placement_policy policy_ = placement_policy::round_robin;
+  std::mutex placement_mtx_;
+  std::chrono::steady_clock::time_point window_time_ =
+      std::chrono::steady_clock::now();
   std::vector<std::shared_ptr<asio::io_context>> io_contexts_;
   std::vector<asio::executor_work_guard<asio::io_context::executor_type>>
       works_;
@@ -59,14 +200,27 @@ private:
   std::atomic<size_t> next_ = 0;
 };
 
-inline auto
-get_global_executor(unsigned pool_size = std::thread::hardware_concurrency()) {
+namespace detail {
+inline io_context_pool &global_io_context_pool(
+    unsigned pool_size = std::thread::hardware_concurrency()) {
   static auto g_io_context_pool = std::make_shared<io_context_pool>(pool_size);
   [[maybe_unused]] static bool run_helper = [](auto pool) {
     std::thread thrd{[pool] { pool->run(); }};
     thrd.detach();
     return true;
   }(g_io_context_pool);
-  return g_io_context_pool->get_executor();
+  return *g_io_context_pool;
+}
+} // namespace detail
+
+inline auto
+get_global_executor(unsigned pool_size = std::thread::hardware_concurrency()) {
+  return detail::global_io_context_pool(pool_size).get_executor();
+}
+
+// pin the threads of the global executor, which the clients use by default,
+// see io_context_pool::set_cpu_affinity.
+inline void set_global_cpu_affinity(const std::vector<int> &cores) {
+  detail::global_io_context_pool().set_cpu_affinity(cores);
 }
 } // namespace rest_rpc
\ No newline at end of file
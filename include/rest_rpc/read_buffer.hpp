@@ -0,0 +1,61 @@
+#pragma once
+#include "string_resize.hpp"
+#include "use_asio.hpp"
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace rest_rpc {
+// A read-ahead buffer: the socket reads as much as is available into the free
+// tail, and the frames are parsed from the readable head. The unread data is
+// moved to the front only when the tail is too small, so a batch of pipelined
+// frames costs one read.
+class read_buffer {
+public:
+  explicit read_buffer(size_t init_size = 8 * 1024) : init_size_(init_size) {}
+
+  std::string_view data() const {
+    return std::string_view(buf_.data() + begin_, end_ - begin_);
+  }
+
+  size_t size() const { return end_ - begin_; }
+
+  bool empty() const { return begin_ == end_; }
+
+  void consume(size_t n) {
+    begin_ += (std::min)(n, size());
+    if (begin_ == end_) {
+      begin_ = 0;
+      end_ = 0;
+    }
+  }
+
+  // the writable tail, at least n bytes.
+  asio::mutable_buffer prepare(size_t n) {
+    if (buf_.size() - end_ < n) {
+      if (begin_ > 0) {
+        size_t len = size();
+        std::memmove(buf_.data(), buf_.data() + begin_, len);
+        begin_ = 0;
+        end_ = len;
+      }
+
+      if (buf_.size() - end_ < n) {
+        size_t new_size = (std::max)(buf_.size() * 2, end_ + n);
+        new_size = (std::max)(new_size, init_size_);
+        detail::resize(buf_, new_size);
+      }
+    }
+
+    return asio::buffer(buf_.data() + end_, buf_.size() - end_);
+  }
+
+  void commit(size_t n) { end_ += n; }
+
+private:
+  std::string buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  size_t init_size_;
+};
+} // namespace rest_rpc
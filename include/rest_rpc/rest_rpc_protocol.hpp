@@ -20,6 +20,9 @@ inline uint64_t ntohll(uint64_t value) {
 
 namespace rest_rpc {
 inline constexpr uint8_t REST_MAGIC_NUM = 39;
+// the default max length of the body and the attachment of a frame, the
+// peer sending a longer one is disconnected, see set_max_frame_length.
+inline constexpr uint64_t REST_DEFAULT_MAX_FRAME_LENGTH = 64 * 1024 * 1024;
 struct rest_rpc_header {
   uint8_t magic = REST_MAGIC_NUM;
   uint8_t version;
@@ -31,6 +34,13 @@ struct rest_rpc_header {
   uint64_t attach_length;
 };
 
+// the lengths are checked one by one before they are added, so the sum
+// can't overflow.
+inline bool valid_lengths(const rest_rpc_header &header, uint64_t max_length) {
+  return header.body_len <= max_length &&
+         header.attach_length <= max_length - header.body_len;
+}
+
 inline void prepare_for_send(rest_rpc_header &header) {
   using namespace detail;
   header.function_id = htonl(header.function_id);
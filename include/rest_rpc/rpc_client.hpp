@@ -4,6 +4,7 @@
 #include "error_code.h"
 #include "io_context_pool.hpp"
 #include "logger.hpp"
+#include "read_buffer.hpp"
 // #include "meta_util.hpp"
 #include "rest_rpc_protocol.hpp"
 #include "string_resize.hpp"
@@ -12,6 +13,9 @@
 #include "util.hpp"
 #include <asio/experimental/awaitable_operators.hpp>
 #include <asio/steady_timer.hpp>
+#include <algorithm>
+#include <deque>
+#include <span>
 using namespace asio::experimental::awaitable_operators;
 
 namespace rest_rpc {
@@ -22,9 +26,63 @@ template <typename R> struct call_result {
 
 template <> struct call_result<void> { rpc_errc ec; };
 
+// the result of a call with attachments, the attachment of the response is
+// read from the socket into it directly.
+template <typename R> struct attachment_result {
+  rpc_errc ec;
+  R value;
+  std::string attachment;
+};
+
+template <> struct attachment_result<void> {
+  rpc_errc ec;
+  std::string attachment;
+};
+
+// In multiplexing mode a std::string_view result refers to the body owned by
+// the result, it is valid while the result or a copy of it lives. Without
+// multiplexing it refers to the buffer of the client and is valid until the
+// next call.
+template <> struct call_result<std::string_view> {
+  rpc_errc ec;
+  std::string_view value;
+  std::shared_ptr<const std::string> body;
+};
+
+template <> struct attachment_result<std::string_view> {
+  rpc_errc ec;
+  std::string_view value;
+  std::string attachment;
+  std::shared_ptr<const std::string> body;
+};
+
+// Abandons a multiplexed call before its reply, see
+// rpc_client::cancellable_call_for. It is only used on the client executor.
+class call_canceller {
+public:
+  void cancel() {
+    cancelled_ = true;
+    if (auto cancel = std::exchange(cancel_, nullptr)) {
+      cancel();
+    }
+  }
+
+  bool cancelled() const { return cancelled_; }
+
+private:
+  friend class rpc_client;
+  bool cancelled_ = false;
+  std::function<void()> cancel_;
+};
+
 class rpc_client {
 public:
   rpc_client() : socket_(std::make_shared<socket_t>(get_global_executor())) {}
+
+  // the clients created with one executor can be used by the coroutines of
+  // that executor without switching threads.
+  explicit rpc_client(asio::any_io_executor executor)
+      : socket_(std::make_shared<socket_t>(std::move(executor))) {}
   ~rpc_client() { close(); }
 
   auto get_executor() { return socket_->get_executor(); }
@@ -56,6 +114,11 @@ public:
     auto it = endpoints.begin();
 
     auto endpoint = it->endpoint();
+    if (endpoint.address().is_v6() && socket_->impl_.is_open()) {
+      // the socket is opened for IPv4 by reset.
+      std::error_code ignored;
+      socket_->impl_.close(ignored);
+    }
     auto conn_r = co_await (watchdog(duration) ||
                             socket_->impl_.async_connect(
                                 endpoint, asio::as_tuple(asio::use_awaitable)));
@@ -76,6 +139,13 @@ public:
       socket_->impl_.set_option(asio::ip::tcp::no_delay(true));
     }
 
+    if (multiplexing_) {
+      asio::co_spawn(socket_->get_executor(),
+                     read_loop(socket_, socket_->generation_, cross_ending_,
+                               max_frame_length_),
+                     asio::detached);
+    }
+
     co_return std::error_code{};
   }
 
@@ -104,25 +174,58 @@ public:
   asio::awaitable<
       call_result<return_type_t<function_return_type_t<decltype(func)>>>>
   call_for(auto duration, Args &&...args) {
-    using args_tuple = function_parameters_t<decltype(func)>;
-    static_assert(std::is_constructible_v<args_tuple, Args...>,
-                  "called rpc function and arguments are not match");
+    return call_for_impl<func, false>(duration, {}, nullptr,
+                                      std::forward<Args>(args)...);
+  }
 
-    rest_rpc_header header{};
-    header.function_id = get_key<func>();
-    using R = return_type_t<function_return_type_t<decltype(func)>>;
-    auto r = co_await (watchdog(duration) ||
-                       call_impl<R>(header, std::forward<Args>(args)...));
-    if (r.index() == 0) {
-      co_return call_result<R>{rpc_errc::request_timeout};
-    }
-    co_return std::get<1>(r);
+  // In multiplexing mode the call is abandoned if the canceller is cancelled
+  // before the reply, it returns rpc_errc::request_cancelled and a cancel
+  // frame is sent for it. Without multiplexing the canceller is ignored.
+  template <auto func, typename... Args>
+  asio::awaitable<
+      call_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  cancellable_call_for(call_canceller &canceller, auto duration,
+                       Args &&...args) {
+    co_return co_await call_for_impl<func, false>(
+        duration, {}, &canceller, std::forward<Args>(args)...);
+  }
+
+  // the attachments are sent after the args by scatter/gather without
+  // copying, the viewed data must outlive the call. The handler gets them by
+  // get_context().request_attachment(), and the attachment set by
+  // get_context().set_response_attachment() is returned in the result.
+  template <auto func, typename... Args>
+  asio::awaitable<
+      attachment_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  call_with_attachment(std::vector<std::string_view> attachments,
+                       Args &&...args) {
+    co_return co_await call_for_impl<func, true>(
+        std::chrono::seconds(5), attachments, nullptr,
+        std::forward<Args>(args)...);
+  }
+
+  template <auto func, typename... Args>
+  asio::awaitable<
+      attachment_result<return_type_t<function_return_type_t<decltype(func)>>>>
+  call_for_with_attachment(auto duration,
+                           std::vector<std::string_view> attachments,
+                           Args &&...args) {
+    co_return co_await call_for_impl<func, true>(
+        duration, attachments, nullptr, std::forward<Args>(args)...);
   }
 
   template <typename R = void>
   asio::awaitable<call_result<R>> subscribe(std::string_view topic) {
-    uint32_t topic_id =
-        MD5::MD5Hash32(topic.data(), (uint32_t)topic.size()); // topic id
+    return subscribe<R>(
+        MD5::MD5Hash32(topic.data(), (uint32_t)topic.size())); // topic id
+  }
+
+  template <typename R = void>
+  asio::awaitable<call_result<R>> subscribe(uint32_t topic_id) {
+    if (multiplexing_) {
+      co_return co_await multiplex_subscribe<R>(topic_id);
+    }
+
     bool b = false;
     call_result<R> ret{};
     auto it = socket_->sub_ops_.find(topic_id);
@@ -136,7 +239,8 @@ public:
       std::tie(b, ret) = co_await (
           asio::async_compose<decltype(asio::use_awaitable), void(bool)>(
               std::ref(it->second), asio::use_awaitable) &&
-          call_impl<R>(header));
+          call_impl<R>(header, std::chrono::steady_clock::duration::max(),
+                       {}, nullptr));
     } else {
       std::tie(b, ret) = co_await (
           asio::async_compose<decltype(asio::use_awaitable), void(bool)>(
@@ -144,14 +248,169 @@ public:
           wait_response<R>());
     }
 
+    if (auto it = socket_->sub_ops_.find(topic_id);
+        it != socket_->sub_ops_.end() && it->second.unsubscribed) {
+      socket_->sub_ops_.erase(it);
+      ret = {};
+      ret.ec = rpc_errc::unsubscribed;
+    }
     co_return std::move(ret);
   }
 
+  // A long-lived subscription of a topic, next() waits for the messages and
+  // takes all the received ones as a batch. In multiplexing mode the messages
+  // received in one read are delivered in one wakeup, otherwise each batch has
+  // one message. The subscription and subscribe() of the same topic share the
+  // messages.
+  template <typename R> class subscription {
+    static_assert(!std::is_same_v<R, std::string_view>,
+                  "a batch can't keep the viewed messages, use std::string");
+
+  public:
+    subscription(rpc_client &client, uint32_t topic_id)
+        : client_(&client), topic_id_(topic_id) {}
+
+    // The batch is cleared first, it is not ok when the subscription ends or
+    // a message with an error is received, the messages before it are
+    // returned first.
+    asio::awaitable<rpc_errc> next(std::vector<R> &batch) {
+      batch.clear();
+      if (client_->multiplexing_) {
+        co_return co_await client_->multiplex_subscribe_batch<R>(topic_id_,
+                                                                 batch);
+      }
+
+      auto result = co_await client_->subscribe<R>(topic_id_);
+      if (result.ec == rpc_errc::ok) {
+        batch.push_back(std::move(result.value));
+      }
+      co_return result.ec;
+    }
+
+    uint32_t topic_id() const { return topic_id_; }
+
+  private:
+    rpc_client *client_;
+    uint32_t topic_id_;
+  };
+
+  // the subscribe message is sent by the first next().
+  template <typename R>
+  subscription<R> subscribe_stream(std::string_view topic) {
+    return subscription<R>(
+        *this, MD5::MD5Hash32(topic.data(), (uint32_t)topic.size()));
+  }
+
+  // the server stops publishing the topic to this client, a subscriber
+  // waiting on the topic gets rpc_errc::unsubscribed. Without multiplexing the
+  // waiter is reading the socket, it is released by the next message or the
+  // close of the connection.
+  asio::awaitable<rpc_errc> unsubscribe(std::string_view topic) {
+    uint32_t topic_id = MD5::MD5Hash32(topic.data(), (uint32_t)topic.size());
+    auto socket = socket_;
+    if (socket->has_closed_) {
+      co_return rpc_errc::socket_closed;
+    }
+
+    rest_rpc_header header{};
+    header.msg_type = 2; // unsubscribe
+    header.function_id = topic_id;
+    if (cross_ending_) {
+      prepare_for_send(header);
+    }
+
+    if (multiplexing_) {
+      auto it = socket->topics_.find(topic_id);
+      if (it == socket->topics_.end()) {
+        co_return rpc_errc::ok;
+      }
+      auto handler = it->second.event.take_handler();
+      socket->topics_.erase(it);
+      if (handler) {
+        handler();
+      }
+      socket->send_queue_.push_back({header, {}});
+      if (!socket->writing_) {
+        co_await flush_send_queue(socket);
+      }
+      co_return socket->has_closed_ ? rpc_errc::write_error : rpc_errc::ok;
+    }
+
+    auto it = socket->sub_ops_.find(topic_id);
+    if (it == socket->sub_ops_.end()) {
+      co_return rpc_errc::ok;
+    }
+    if (it->second.waiting()) {
+      // the waiter holds the operation, it erases it when it is woken up.
+      it->second.unsubscribed = true;
+    } else {
+      socket->sub_ops_.erase(it);
+    }
+    auto [ec, size] = co_await asio::async_write(
+        socket->impl_, asio::buffer(&header, sizeof(rest_rpc_header)),
+        asio::as_tuple(asio::use_awaitable));
+    if (ec) {
+      close_socket(*socket);
+      co_return rpc_errc::write_error;
+    }
+    co_return rpc_errc::ok;
+  }
+
   void enable_tcp_no_delay(bool r) { tcp_no_delay_ = r; }
 
   void enable_cross_ending(bool r) { cross_ending_ = r; }
+
+  // The max length of the body and the attachment of a response, the
+  // default is REST_DEFAULT_MAX_FRAME_LENGTH. A longer one is a protocol
+  // error and the connection is closed. It should be set before connect.
+  void set_max_frame_length(uint64_t n) { max_frame_length_ = n; }
+
+  // Allow many coroutines to call concurrently on one connection, each
+  // request is stamped with a unique seq_num and the responses are dispatched
+  // to the waiters by a dedicated reader loop. It should be set before
+  // connect, and all the calls must be made on the client executor.
+  void enable_multiplexing(bool r) { multiplexing_ = r; }
+
+  // In multiplexing mode a timed out call is abandoned without closing the
+  // connection, and if it is enabled a cancel frame is sent, the server
+  // doesn't respond to the cancelled request and a handler may check
+  // is_cancelled() to stop early.
+  void enable_cancel_on_timeout(bool r) { cancel_on_timeout_ = r; }
+
+  // the codec of the args and the result, it is sent in the serialize_type
+  // field of each request and the server responds with the same codec.
+  void set_serialize_type(rest_rpc::serialize_type type) {
+    serialize_type_ = type;
+  }
   bool has_closed() const { return socket_->has_closed_; }
 
+  // Whether an idle connection is still usable, without multiplexing nothing
+  // reads the idle socket, so it is peeked without blocking, the connection
+  // is broken if the server has closed it or sent something unasked. It must
+  // not be called while a call is in progress, and only in the executor of
+  // the client.
+  bool probe() {
+    if (socket_->has_closed_) {
+      return false;
+    }
+    if (multiplexing_) {
+      return true;
+    }
+
+    auto &impl = socket_->impl_;
+    std::error_code ec;
+    bool non_blocking = impl.non_blocking();
+    impl.non_blocking(true, ec);
+    if (ec) {
+      return false;
+    }
+    char c;
+    impl.receive(asio::buffer(&c, 1), asio::socket_base::message_peek, ec);
+    std::error_code ignored;
+    impl.non_blocking(non_blocking, ignored);
+    return ec == asio::error::would_block;
+  }
+
   void close() {
     if (socket_ == nullptr || socket_->has_closed_)
       return;
@@ -161,39 +420,108 @@ public:
   }
 
 private:
-  template <typename... Args> auto get_buffer(Args &&...args) {
+  template <typename R, bool WithAttachment>
+  using result_t = std::conditional_t<WithAttachment, attachment_result<R>,
+                                      call_result<R>>;
+
+  template <auto func, bool WithAttachment, typename... Args>
+  asio::awaitable<result_t<
+      return_type_t<function_return_type_t<decltype(func)>>, WithAttachment>>
+  call_for_impl(auto duration, std::span<const std::string_view> attachments,
+                call_canceller *canceller, Args &&...args) {
+    using args_tuple = function_parameters_t<decltype(func)>;
+    static_assert(std::is_constructible_v<args_tuple, Args...>,
+                  "called rpc function and arguments are not match");
+
+    rest_rpc_header header{};
+    header.serialize_type = uint8_t(serialize_type_);
+    header.function_id = get_key<func>();
+    using R = return_type_t<function_return_type_t<decltype(func)>>;
+    if (multiplexing_) {
+      // a timeout only abandons the call, the connection is kept.
+      co_return co_await call_impl<R, WithAttachment>(
+          header, duration, attachments, canceller,
+          std::forward<Args>(args)...);
+    }
+
+    // the reply of a timed out call can't be told apart from the next one
+    // without multiplexing, so the connection is closed by the deadline.
+    auto socket = socket_;
+    uint64_t id = ++socket->seq_num_;
+    socket->watched_ = id;
+    schedule_deadline(socket, deadline_after(duration), id, 0);
+    auto result = co_await call_impl<R, WithAttachment>(
+        header, duration, attachments, nullptr, std::forward<Args>(args)...);
+    if (socket->watched_ != id) {
+      result = {};
+      result.ec = rpc_errc::request_timeout;
+    }
+    socket->watched_ = 0;
+    co_return result;
+  }
+
+  template <typename... Args> packed_args get_buffer(Args &&...args) {
     if constexpr (sizeof...(Args) == 0) {
-      return rpc_codec::pack_args();
+      return rpc_codec::pack_as(serialize_type_);
     } else if constexpr (sizeof...(Args) > 1) {
-      return rpc_codec::pack_args(
-          std::forward_as_tuple(std::forward<Args>(args)...));
+      return rpc_codec::pack_as(
+          serialize_type_, std::forward_as_tuple(detail::as_packable(
+                               std::forward<Args>(args))...));
     } else {
       if constexpr (util::is_basic_v<Args...>) {
-        return rpc_codec::pack_args(std::forward<Args>(args)...);
+        return rpc_codec::pack_as(serialize_type_, std::forward<Args>(args)...);
       } else {
-        return rpc_codec::pack_args(
+        return rpc_codec::pack_as(
+            serialize_type_,
             std::forward_as_tuple(std::forward<Args>(args)...));
       }
     }
   }
 
-  template <typename R, typename... Args>
-  asio::awaitable<call_result<R>> call_impl(rest_rpc_header &header,
-                                            Args &&...args) {
-    auto buf = get_buffer(std::forward<Args>(args)...);
-    header.body_len = buf.size();
+  template <typename R, bool WithAttachment = false, typename... Args>
+  asio::awaitable<result_t<R, WithAttachment>>
+  call_impl(rest_rpc_header &header, std::chrono::steady_clock::duration timeout,
+            std::span<const std::string_view> attachments,
+            call_canceller *canceller, Args &&...args) {
+    packed_args buf;
+    try {
+      buf = get_buffer(std::forward<Args>(args)...);
+    } catch (const std::exception &e) {
+      REST_LOG_WARNING << "pack args failed: " << e.what();
+      result_t<R, WithAttachment> result{};
+      result.ec = rpc_errc::invalid_argument;
+      co_return result;
+    }
+    auto body = buf.data();
+    header.body_len = body.size();
+    for (auto attachment : attachments) {
+      header.attach_length += attachment.size();
+    }
+    uint64_t seq_num = 0;
+    if (multiplexing_) {
+      seq_num = ++socket_->seq_num_;
+      header.seq_num = seq_num;
+    }
     if (cross_ending_) {
       prepare_for_send(header);
     }
 
+    if (multiplexing_) {
+      co_return co_await multiplex_call<R, WithAttachment>(
+          seq_num, header, body, attachments, timeout, canceller);
+    }
+
     std::vector<asio::const_buffer> buffers;
-    buffers.reserve(2);
+    buffers.reserve(2 + attachments.size());
     buffers.push_back(asio::buffer(&header, sizeof(rest_rpc_header)));
-    if constexpr (sizeof...(Args) > 0) {
-      buffers.push_back(asio::buffer(buf.data(), buf.size()));
+    if (!body.empty()) {
+      buffers.push_back(asio::buffer(body.data(), body.size()));
+    }
+    for (auto attachment : attachments) {
+      buffers.push_back(asio::buffer(attachment.data(), attachment.size()));
     }
 
-    call_result<R> result{};
+    result_t<R, WithAttachment> result{};
     std::error_code ec;
     size_t size;
     std::tie(ec, size) = co_await asio::async_write(
@@ -204,11 +532,12 @@ private:
       co_return result;
     }
 
-    co_return co_await wait_response<R>();
+    co_return co_await wait_response<R, WithAttachment>();
   }
 
-  template <typename R> asio::awaitable<call_result<R>> wait_response() {
-    call_result<R> result{};
+  template <typename R, bool WithAttachment = false>
+  asio::awaitable<result_t<R, WithAttachment>> wait_response() {
+    result_t<R, WithAttachment> result{};
     std::error_code ec;
     size_t size;
     rest_rpc_header resp_header;
@@ -230,6 +559,12 @@ private:
     if (cross_ending_) {
       parse_recieved(resp_header);
     }
+    if (!valid_lengths(resp_header, max_frame_length_)) {
+      result.ec = rpc_errc::protocol_error;
+      close_socket(*socket_);
+      comple_all();
+      co_return result;
+    }
 
     detail::resize(socket_->body_, resp_header.body_len);
     std::tie(ec, size) = co_await asio::async_read(
@@ -245,8 +580,34 @@ private:
     }
     result.ec = (rpc_errc)socket_->body_[0];
     if constexpr (!std::is_void_v<R>) {
-      result.value = rpc_codec::unpack<R>(std::string_view(
-          socket_->body_.data() + 1, resp_header.body_len - 1));
+      if (result.ec == rpc_errc::ok) {
+        result.value = rpc_codec::unpack_as<R>(
+            serialize_type(resp_header.serialize_type),
+            std::string_view(socket_->body_.data() + 1,
+                             resp_header.body_len - 1));
+      }
+    }
+
+    if (resp_header.attach_length > 0) {
+      std::string discard;
+      auto &attachment = [&]() -> std::string & {
+        if constexpr (WithAttachment) {
+          return result.attachment;
+        } else {
+          return discard;
+        }
+      }();
+      detail::resize(attachment, resp_header.attach_length);
+      std::tie(ec, size) = co_await asio::async_read(
+          socket_->impl_, asio::buffer(attachment.data(), attachment.size()),
+          asio::as_tuple(asio::use_awaitable));
+      if (ec) {
+        REST_LOG_WARNING << "read attachment error: " << ec.message();
+        result.ec = rpc_errc::read_error;
+        close_socket(*socket_);
+        comple_all();
+        co_return result;
+      }
     }
 
     if (resp_header.msg_type == 1) { // pubsub
@@ -259,9 +620,153 @@ private:
   }
 
   void comple_all() {
+    // a woken up waiter may erase its operation.
+    std::vector<uint32_t> topics;
     for (auto &pair : socket_->sub_ops_) {
-      pair.second.complete(false);
+      topics.push_back(pair.first);
+    }
+    for (auto topic_id : topics) {
+      if (auto it = socket_->sub_ops_.find(topic_id);
+          it != socket_->sub_ops_.end()) {
+        it->second.complete(false);
+      }
+    }
+  }
+
+  template <typename R, bool WithAttachment>
+  asio::awaitable<result_t<R, WithAttachment>>
+  multiplex_call(uint64_t seq_num, const rest_rpc_header &header,
+                 std::string_view body,
+                 std::span<const std::string_view> attachments,
+                 std::chrono::steady_clock::duration timeout,
+                 call_canceller *canceller) {
+    auto socket = socket_;
+    result_t<R, WithAttachment> result{};
+    if (socket->has_closed_) {
+      result.ec = rpc_errc::socket_closed;
+      co_return result;
+    }
+    if (canceller && canceller->cancelled_) {
+      result.ec = rpc_errc::request_cancelled;
+      co_return result;
+    }
+
+    auto &call = socket->calls_[seq_num];
+    schedule_deadline(socket, deadline_after(timeout), seq_num,
+                      header.seq_num);
+    if (canceller) {
+      canceller->cancel_ = [socket, seq_num, header_seq = header.seq_num] {
+        expire_call(*socket, seq_num, header_seq, rpc_errc::request_cancelled);
+      };
+    }
+    socket->send_queue_.push_back({header, body, attachments});
+    if (!socket->writing_) {
+      co_await flush_send_queue(socket);
+    }
+
+    if (!call.done) {
+      co_await call.event.wait();
+    }
+    if (canceller) {
+      canceller->cancel_ = nullptr;
+    }
+
+    result.ec = call.ec;
+    bool abandoned = result.ec == rpc_errc::request_cancelled ||
+                     (result.ec == rpc_errc::request_timeout &&
+                      cancel_on_timeout_);
+    if (abandoned && !call.unsent && !socket->has_closed_) {
+      rest_rpc_header cancel{};
+      cancel.msg_type = 3; // cancel
+      cancel.seq_num = seq_num;
+      if (cross_ending_) {
+        prepare_for_send(cancel);
+      }
+      socket->send_queue_.push_back({cancel, {}});
+      if (!socket->writing_) {
+        co_await flush_send_queue(socket);
+      }
+    }
+    if (result.ec == rpc_errc::ok) {
+      std::string_view data(call.body);
+      if constexpr (std::is_same_v<R, std::string_view>) {
+        // the view refers to the body owned by the result.
+        result.body = std::make_shared<const std::string>(std::move(call.body));
+        data = *result.body;
+      }
+      result.ec = (rpc_errc)data[0];
+      if constexpr (!std::is_void_v<R>) {
+        if (result.ec == rpc_errc::ok) {
+          result.value = rpc_codec::unpack_as<R>(call.type, data.substr(1));
+        }
+      }
+      if constexpr (WithAttachment) {
+        result.attachment = std::move(call.attachment);
+      }
+    }
+    socket->calls_.erase(seq_num);
+    co_return std::move(result);
+  }
+
+  template <typename R>
+  asio::awaitable<call_result<R>> multiplex_subscribe(uint32_t topic_id) {
+    auto socket = socket_;
+    call_result<R> result{};
+    co_await add_topic(socket, topic_id);
+    topic_queue *topic = nullptr;
+    result.ec = co_await wait_topic(socket, topic_id, topic);
+    if (result.ec != rpc_errc::ok) {
+      co_return result;
+    }
+
+    auto msg = std::move(topic->messages.front());
+    topic->messages.pop_front();
+    std::string_view data(msg);
+    if constexpr (std::is_same_v<R, std::string_view>) {
+      result.body = std::make_shared<const std::string>(std::move(msg));
+      data = *result.body;
+    }
+    result.ec = (rpc_errc)data[0];
+    if constexpr (!std::is_void_v<R>) {
+      if (result.ec == rpc_errc::ok) {
+        result.value = rpc_codec::unpack<R>(data.substr(1));
+      }
+    }
+    co_return std::move(result);
+  }
+
+  template <typename R>
+  asio::awaitable<rpc_errc> multiplex_subscribe_batch(uint32_t topic_id,
+                                                      std::vector<R> &batch) {
+    auto socket = socket_;
+    if (socket->has_closed_) {
+      co_return rpc_errc::socket_closed;
     }
+    co_await add_topic(socket, topic_id);
+    topic_queue *topic = nullptr;
+    auto ec = co_await wait_topic(socket, topic_id, topic);
+    if (ec != rpc_errc::ok) {
+      co_return ec;
+    }
+
+    // a message with an error ends the batch, it is returned by the next
+    // call if the batch is not empty.
+    auto &messages = topic->messages;
+    batch.reserve(batch.size() + messages.size());
+    while (!messages.empty()) {
+      auto &msg = messages.front();
+      if (auto ec = (rpc_errc)msg[0]; ec != rpc_errc::ok) {
+        if (batch.empty()) {
+          messages.pop_front();
+          co_return ec;
+        }
+        break;
+      }
+      batch.push_back(rpc_codec::unpack<R>(
+          std::string_view(msg.data() + 1, msg.size() - 1)));
+      messages.pop_front();
+    }
+    co_return rpc_errc::ok;
   }
 
   asio::awaitable<std::error_code> watchdog(auto duration) {
@@ -285,26 +790,445 @@ private:
       };
     }
 
-    void complete(bool r) { complete_handler_(r); }
+    void complete(bool r) {
+      if (auto handler = std::exchange(complete_handler_, nullptr)) {
+        handler(r);
+      }
+    }
+
+    bool waiting() const { return complete_handler_ != nullptr; }
+
+    // unsubscribed while a subscriber is waiting.
+    bool unsubscribed = false;
 
   private:
     std::function<void(bool)> complete_handler_;
   };
 
+  struct pending_call {
+    bool done = false;
+    // expired before its frame was written, the frame has been dropped.
+    bool unsent = false;
+    rpc_errc ec = rpc_errc::ok;
+    serialize_type type = serialize_type::rest;
+    std::string body;
+    std::string attachment;
+    wait_event event;
+  };
+
+  struct topic_queue {
+    std::deque<std::string> messages;
+    wait_event event;
+  };
+
+  struct send_frame {
+    rest_rpc_header header;
+    std::string_view body;
+    std::span<const std::string_view> attachments{};
+    // the call has given up before the frame was written, its body may be
+    // gone. The frame stays in the queue and is skipped by the writer, so
+    // the frames of the write in progress are not moved.
+    bool dropped = false;
+  };
+
+  struct deadline {
+    std::chrono::steady_clock::time_point when;
+    uint64_t seq_num;
+    // the seq_num as sent, it differs with cross_ending.
+    uint64_t header_seq;
+    bool operator>(const deadline &other) const { return when > other.when; }
+  };
+
   struct socket_t {
-    socket_t(auto executor) : impl_(executor) {}
+    socket_t(auto executor) : impl_(executor), deadline_timer_(executor) {}
     asio::any_io_executor get_executor() { return impl_.get_executor(); }
     asio::ip::tcp::socket impl_;
     std::atomic<bool> has_closed_ = true;
     std::string body_;
     std::unordered_map<uint32_t, sub_operation> sub_ops_;
+
+    // multiplexing
+    uint64_t generation_ = 0;
+    uint64_t seq_num_ = 0;
+    bool writing_ = false;
+    std::deque<send_frame> send_queue_;
+    // the number of the frames at the front of the queue in the write in
+    // progress.
+    size_t in_flight_ = 0;
+    std::unordered_map<uint64_t, pending_call> calls_;
+    std::unordered_map<uint32_t, topic_queue> topics_;
+
+    // the deadlines of the calls, a min-heap driven by one timer.
+    std::vector<deadline> deadlines_;
+    asio::steady_timer deadline_timer_;
+    std::chrono::steady_clock::time_point armed_ =
+        std::chrono::steady_clock::time_point::max();
+    // the id of the call in flight without multiplexing, cleared by its
+    // deadline.
+    uint64_t watched_ = 0;
   };
 
+  inline static constexpr size_t read_ahead_size = 4096;
+
   inline static void close_socket(socket_t &socket) {
     std::error_code ec;
     socket.impl_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
     socket.impl_.close(ec);
     socket.has_closed_ = true;
+    clear_deadlines(socket);
+  }
+
+  static std::chrono::steady_clock::time_point
+  deadline_after(std::chrono::steady_clock::duration timeout) {
+    auto now = std::chrono::steady_clock::now();
+    if (timeout >= std::chrono::steady_clock::time_point::max() - now) {
+      return std::chrono::steady_clock::time_point::max();
+    }
+    return now + timeout;
+  }
+
+  // The deadlines are pushed to the heap without allocating a timer, the
+  // ones of the finished calls are left in the heap and skipped when they
+  // expire. The timer is only rearmed for a deadline earlier than the armed
+  // one, which is rare when all the calls have the same timeout.
+  static void schedule_deadline(const std::shared_ptr<socket_t> &socket,
+                                std::chrono::steady_clock::time_point when,
+                                uint64_t seq_num, uint64_t header_seq) {
+    if (when == std::chrono::steady_clock::time_point::max() ||
+        socket->has_closed_) {
+      return;
+    }
+    auto &deadlines = socket->deadlines_;
+    if (deadlines.size() >= 64 &&
+        deadlines.size() > 2 * (socket->calls_.size() + 1)) {
+      // most of them belong to the finished calls, drop them.
+      std::erase_if(deadlines, [&](const deadline &d) {
+        return d.seq_num != socket->watched_ &&
+               !socket->calls_.contains(d.seq_num);
+      });
+      std::make_heap(deadlines.begin(), deadlines.end(), std::greater<>{});
+    }
+    deadlines.push_back({when, seq_num, header_seq});
+    std::push_heap(deadlines.begin(), deadlines.end(), std::greater<>{});
+    if (when < socket->armed_) {
+      arm_deadline_timer(socket, when);
+    }
+  }
+
+  static void arm_deadline_timer(const std::shared_ptr<socket_t> &socket,
+                                 std::chrono::steady_clock::time_point when) {
+    socket->armed_ = when;
+    // the pending wait, if any, is cancelled.
+    socket->deadline_timer_.expires_at(when);
+    socket->deadline_timer_.async_wait(
+        [socket, generation = socket->generation_](std::error_code ec) {
+          if (ec || generation != socket->generation_) {
+            return;
+          }
+          socket->armed_ = std::chrono::steady_clock::time_point::max();
+          expire_deadlines(*socket);
+          auto &deadlines = socket->deadlines_;
+          if (!deadlines.empty() && deadlines.front().when < socket->armed_) {
+            arm_deadline_timer(socket, deadlines.front().when);
+          }
+        });
+  }
+
+  static void expire_deadlines(socket_t &socket) {
+    auto now = std::chrono::steady_clock::now();
+    auto &deadlines = socket.deadlines_;
+    // the expired calls may be resumed inline and schedule new deadlines, or
+    // close the socket and clear the heap.
+    while (!deadlines.empty() && deadlines.front().when <= now) {
+      std::pop_heap(deadlines.begin(), deadlines.end(), std::greater<>{});
+      auto d = deadlines.back();
+      deadlines.pop_back();
+      if (d.seq_num == socket.watched_) {
+        socket.watched_ = 0;
+        close_socket(socket);
+      } else {
+        expire_call(socket, d.seq_num, d.header_seq,
+                    rpc_errc::request_timeout);
+      }
+    }
+  }
+
+  static void clear_deadlines(socket_t &socket) {
+    socket.deadlines_.clear();
+    socket.armed_ = std::chrono::steady_clock::time_point::max();
+    socket.deadline_timer_.cancel();
+  }
+
+  // Only the call timed out or cancelled is completed with ec, its late reply
+  // is discarded by the reader. A request not written yet is marked dropped,
+  // the connection is only closed if it is in the write in progress.
+  inline static void expire_call(socket_t &socket, uint64_t seq_num,
+                                 uint64_t header_seq, rpc_errc ec) {
+    auto it = socket.calls_.find(seq_num);
+    if (it == socket.calls_.end() || it->second.done) {
+      return;
+    }
+    auto &call = it->second;
+    auto &queue = socket.send_queue_;
+    for (size_t i = 0; i < queue.size(); i++) {
+      if (queue[i].header.seq_num != header_seq) {
+        continue;
+      }
+      if (i < socket.in_flight_) {
+        // a partly written frame can't be taken back.
+        close_socket(socket);
+        complete_calls(socket, rpc_errc::request_timeout);
+        return;
+      }
+      queue[i].dropped = true;
+      call.unsent = true;
+      break;
+    }
+    call.done = true;
+    call.ec = ec;
+    if (auto handler = call.event.take_handler()) {
+      handler();
+    }
+  }
+
+  // wake up all the multiplexed waiters, the handlers are collected first
+  // because the resumed callers will erase their entries.
+  inline static void complete_calls(socket_t &socket, rpc_errc ec) {
+    std::vector<std::function<void()>> handlers;
+    for (auto &[_, call] : socket.calls_) {
+      if (call.done) {
+        continue;
+      }
+      call.done = true;
+      call.ec = ec;
+      if (auto handler = call.event.take_handler()) {
+        handlers.push_back(std::move(handler));
+      }
+    }
+    for (auto &[_, topic] : socket.topics_) {
+      if (auto handler = topic.event.take_handler()) {
+        handlers.push_back(std::move(handler));
+      }
+    }
+    if (!socket.writing_) {
+      socket.send_queue_.clear();
+    }
+    for (auto &handler : handlers) {
+      handler();
+    }
+  }
+
+  // the subscribe message is sent when the topic is added.
+  asio::awaitable<void> add_topic(std::shared_ptr<socket_t> socket,
+                                  uint32_t topic_id) {
+    if (!socket->topics_.try_emplace(topic_id).second) {
+      co_return;
+    }
+    rest_rpc_header header{};
+    header.msg_type = 1; // pub/sub
+    header.function_id = topic_id;
+    if (cross_ending_) {
+      prepare_for_send(header);
+    }
+    socket->send_queue_.push_back({header, {}});
+    if (!socket->writing_) {
+      co_await flush_send_queue(socket);
+    }
+  }
+
+  // wait for the messages of the topic, the topic may have been unsubscribed
+  // while waiting. A topic has one waiter, a second concurrent one gets
+  // rpc_errc::duplicate_topic.
+  static asio::awaitable<rpc_errc> wait_topic(std::shared_ptr<socket_t> socket,
+                                              uint32_t topic_id,
+                                              topic_queue *&topic) {
+    auto generation = socket->generation_;
+    auto it = socket->topics_.find(topic_id);
+    if (it != socket->topics_.end() && it->second.messages.empty() &&
+        !socket->has_closed_) {
+      if (it->second.event.waiting()) {
+        co_return rpc_errc::duplicate_topic;
+      }
+      co_await it->second.event.wait();
+      it = socket->topics_.find(topic_id);
+    }
+    if (it == socket->topics_.end() || it->second.messages.empty()) {
+      // the topics are also cleared by reset.
+      bool closed = socket->has_closed_ || generation != socket->generation_;
+      co_return closed ? rpc_errc::socket_closed : rpc_errc::unsubscribed;
+    }
+    topic = &it->second;
+    co_return rpc_errc::ok;
+  }
+
+  // the writer gathers all the queued frames into one write, the frames
+  // pushed while writing will be sent by the next round.
+  static asio::awaitable<void>
+  flush_send_queue(std::shared_ptr<socket_t> socket) {
+    auto generation = socket->generation_;
+    socket->writing_ = true;
+    std::vector<asio::const_buffer> buffers;
+    std::error_code ec;
+    while (!socket->send_queue_.empty()) {
+      size_t count = socket->send_queue_.size();
+      buffers.clear();
+      for (auto &frame : socket->send_queue_) {
+        if (frame.dropped) {
+          continue;
+        }
+        buffers.push_back(
+            asio::buffer(&frame.header, sizeof(rest_rpc_header)));
+        if (!frame.body.empty()) {
+          buffers.push_back(asio::buffer(frame.body.data(), frame.body.size()));
+        }
+        for (auto attachment : frame.attachments) {
+          buffers.push_back(
+              asio::buffer(attachment.data(), attachment.size()));
+        }
+      }
+
+      if (buffers.empty()) {
+        socket->send_queue_.erase(socket->send_queue_.begin(),
+                                  socket->send_queue_.begin() + count);
+        continue;
+      }
+
+      size_t size;
+      socket->in_flight_ = count;
+      std::tie(ec, size) = co_await asio::async_write(
+          socket->impl_, buffers, asio::as_tuple(asio::use_awaitable));
+      if (generation != socket->generation_) {
+        // the socket has been reset, the queue belongs to the new connection.
+        co_return;
+      }
+      if (ec || socket->has_closed_) {
+        break;
+      }
+      socket->send_queue_.erase(socket->send_queue_.begin(),
+                                socket->send_queue_.begin() + count);
+      socket->in_flight_ = 0;
+    }
+    socket->writing_ = false;
+    socket->in_flight_ = 0;
+
+    if (ec || socket->has_closed_) {
+      // the callers of the queued frames have been or will be completed with
+      // error, the frames must not be touched any more.
+      socket->send_queue_.clear();
+    }
+    if (ec) {
+      REST_LOG_WARNING << "write error: " << ec.message();
+      close_socket(*socket);
+      complete_calls(*socket, rpc_errc::write_error);
+    }
+  }
+
+  // The frames are parsed from a read-ahead buffer, all the complete frames
+  // of one read are dispatched before the waiters are woken up, so the
+  // messages of a topic received together are delivered in one wakeup.
+  static asio::awaitable<void> read_loop(std::shared_ptr<socket_t> socket,
+                                         uint64_t generation,
+                                         bool cross_ending,
+                                         uint64_t max_frame_length) {
+    read_buffer buf;
+    std::vector<std::function<void()>> handlers;
+    rpc_errc errc = rpc_errc::read_error;
+    size_t need = sizeof(rest_rpc_header);
+    while (true) {
+      auto [ec, size] = co_await socket->impl_.async_read_some(
+          buf.prepare((std::max)(need, read_ahead_size)),
+          asio::as_tuple(asio::use_awaitable));
+      if (ec) {
+        break;
+      }
+      buf.commit(size);
+
+      bool error = false;
+      rest_rpc_header header;
+      while (buf.size() >= sizeof(rest_rpc_header)) {
+        std::memcpy(&header, buf.data().data(), sizeof(rest_rpc_header));
+        if (header.magic != REST_MAGIC_NUM) {
+          error = true;
+          break;
+        }
+        if (cross_ending) {
+          parse_recieved(header);
+        }
+        if (header.body_len == 0 ||
+            !valid_lengths(header, max_frame_length)) {
+          error = true;
+          break;
+        }
+
+        size_t frame_size =
+            sizeof(rest_rpc_header) + header.body_len + header.attach_length;
+        if (buf.size() < frame_size) {
+          break;
+        }
+        auto payload = buf.data().substr(sizeof(rest_rpc_header),
+                                         frame_size - sizeof(rest_rpc_header));
+        dispatch_frame(*socket, header, payload.substr(0, header.body_len),
+                       payload.substr(header.body_len), handlers);
+        buf.consume(frame_size);
+      }
+      if (error) {
+        errc = rpc_errc::protocol_error;
+        break;
+      }
+
+      need = sizeof(rest_rpc_header);
+      if (buf.size() >= sizeof(rest_rpc_header)) {
+        need += header.body_len + header.attach_length;
+      }
+      need -= (std::min)(need, buf.size());
+
+      for (auto &handler : handlers) {
+        handler();
+      }
+      handlers.clear();
+      if (generation != socket->generation_) {
+        co_return;
+      }
+    }
+
+    if (generation != socket->generation_) {
+      // the socket has been reset, the waiters are completed by reset.
+      co_return;
+    }
+
+    close_socket(*socket);
+    complete_calls(*socket, errc);
+  }
+
+  // hand a frame to its waiter, the waiter is woken up by the reader later.
+  static void dispatch_frame(socket_t &socket, const rest_rpc_header &header,
+                             std::string_view body, std::string_view attachment,
+                             std::vector<std::function<void()>> &handlers) {
+    std::function<void()> handler;
+    if (header.msg_type == 1) { // pubsub
+      auto it = socket.topics_.find(header.function_id);
+      if (it == socket.topics_.end()) {
+        return;
+      }
+      it->second.messages.emplace_back(body);
+      handler = it->second.event.take_handler();
+    } else {
+      auto it = socket.calls_.find(header.seq_num);
+      if (it == socket.calls_.end()) {
+        // the caller has gone, discard the late response.
+        return;
+      }
+      auto &call = it->second;
+      call.done = true;
+      call.type = serialize_type(header.serialize_type);
+      call.body = body;
+      call.attachment = attachment;
+      handler = call.event.take_handler();
+    }
+
+    if (handler) {
+      handlers.push_back(std::move(handler));
+    }
   }
 
   void reset() {
@@ -313,6 +1237,15 @@ private:
       close_socket(*socket_);
     }
 
+    socket_->generation_++;
+    socket_->writing_ = false;
+    socket_->in_flight_ = 0;
+    socket_->watched_ = 0;
+    clear_deadlines(*socket_);
+    complete_calls(*socket_, rpc_errc::socket_closed);
+    // the topics are subscribed again on the new connection.
+    socket_->topics_.clear();
+
     socket_->impl_ = asio::ip::tcp::socket{executor};
     if (!socket_->impl_.is_open()) {
       std::error_code ec;
@@ -328,6 +1261,10 @@ private:
   std::shared_ptr<socket_t> socket_;
   bool tcp_no_delay_ = true;
   bool cross_ending_ = false;
+  uint64_t max_frame_length_ = REST_DEFAULT_MAX_FRAME_LENGTH;
   bool should_reset_ = false;
+  bool multiplexing_ = false;
+  bool cancel_on_timeout_ = false;
+  rest_rpc::serialize_type serialize_type_ = serialize_type::rest;
 };
 } // namespace rest_rpc
@@ -0,0 +1,287 @@
+#pragma once
+#include "rpc_client.hpp"
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace rest_rpc {
+struct client_pool_config {
+  // the max number of the connections of each endpoint, idle or in use.
+  size_t max_connections = 64;
+  std::chrono::steady_clock::duration connect_timeout = std::chrono::seconds(5);
+  // how long get() waits for a connection when the endpoint is full.
+  std::chrono::steady_clock::duration wait_timeout = std::chrono::seconds(5);
+  // the idle connections are checked every check_interval, the broken ones
+  // are reconnected in the background and the ones idle longer than
+  // max_idle_time are closed. See rpc_client::probe.
+  std::chrono::steady_clock::duration check_interval = std::chrono::seconds(10);
+  std::chrono::steady_clock::duration max_idle_time = std::chrono::seconds(60);
+  bool enable_multiplexing = false;
+};
+
+// A pool of the connections keyed by "host:port". get() hands out an idle
+// connection, or connects a new one while the endpoint has less than
+// max_connections, otherwise it waits for one to be returned. The connection
+// goes back to the pool when the last copy of the returned shared_ptr is
+// released, a closed connection is dropped then. A new connection is bound
+// to the executor of the coroutine which called get().
+class rpc_client_pool {
+public:
+  explicit rpc_client_pool(client_pool_config config = {})
+      : state_(std::make_shared<pool_state>(std::move(config))) {
+    asio::co_spawn(state_->timer.get_executor(), check_idle(state_),
+                   asio::detached);
+  }
+
+  ~rpc_client_pool() {
+    std::vector<std::unique_ptr<rpc_client>> idle;
+    {
+      std::scoped_lock lock(state_->mtx);
+      state_->stopped = true;
+      for (auto &[_, endpoint] : state_->endpoints) {
+        for (auto &conn : endpoint.idle) {
+          idle.push_back(std::move(conn.client));
+        }
+        endpoint.idle.clear();
+        wake_all(endpoint);
+      }
+    }
+    asio::dispatch(state_->timer.get_executor(),
+                   [state = state_] { state->timer.cancel(); });
+  }
+
+  // nullptr if it failed to connect or no connection was returned in time.
+  asio::awaitable<std::shared_ptr<rpc_client>> get(std::string address) {
+    auto state = state_;
+    auto executor = co_await asio::this_coro::executor;
+    auto deadline =
+        std::chrono::steady_clock::now() + state->config.wait_timeout;
+    while (true) {
+      std::shared_ptr<pool_waiter> waiter;
+      {
+        std::scoped_lock lock(state->mtx);
+        if (state->stopped) {
+          co_return nullptr;
+        }
+        auto &endpoint = state->endpoints[address];
+        while (!endpoint.idle.empty()) {
+          auto client = std::move(endpoint.idle.back().client);
+          endpoint.idle.pop_back();
+          if (!client->has_closed()) {
+            co_return make_handle(state, address, std::move(client));
+          }
+          endpoint.count--;
+        }
+
+        if (endpoint.count < state->config.max_connections) {
+          endpoint.count++;
+        } else {
+          if (std::chrono::steady_clock::now() >= deadline) {
+            REST_LOG_WARNING << "no idle connection of " << address;
+            co_return nullptr;
+          }
+          waiter = std::make_shared<pool_waiter>(executor);
+          waiter->timer.expires_at(deadline);
+          endpoint.waiters.push_back(waiter);
+        }
+      }
+
+      if (waiter) {
+        // expired when a connection is returned or dropped.
+        co_await waiter->timer.async_wait(asio::as_tuple(asio::use_awaitable));
+        std::scoped_lock lock(state->mtx);
+        // timed out, the later wakeups go to the other waiters.
+        waiter->waiting = false;
+        continue;
+      }
+
+      auto client = std::make_unique<rpc_client>(executor);
+      auto ec = co_await connect(*client, address, state->config);
+      if (ec) {
+        REST_LOG_WARNING << "connect " << address
+                         << " failed: " << ec.message();
+        std::scoped_lock lock(state->mtx);
+        auto &endpoint = state->endpoints[address];
+        endpoint.count--;
+        wake_one(endpoint);
+        co_return nullptr;
+      }
+      co_return make_handle(state, address, std::move(client));
+    }
+  }
+
+  size_t idle_count(const std::string &address) {
+    std::scoped_lock lock(state_->mtx);
+    auto it = state_->endpoints.find(address);
+    return it == state_->endpoints.end() ? 0 : it->second.idle.size();
+  }
+
+  // the idle and in use connections of the endpoint.
+  size_t connection_count(const std::string &address) {
+    std::scoped_lock lock(state_->mtx);
+    auto it = state_->endpoints.find(address);
+    return it == state_->endpoints.end() ? 0 : it->second.count;
+  }
+
+private:
+  struct idle_client {
+    std::unique_ptr<rpc_client> client;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  // a get() waiting for a connection to be returned or dropped.
+  struct pool_waiter {
+    explicit pool_waiter(asio::any_io_executor executor) : timer(executor) {}
+    asio::steady_timer timer;
+    // guarded by the pool mutex, false once it is woken up or it has stopped
+    // waiting by itself.
+    bool waiting = true;
+  };
+
+  struct endpoint_pool {
+    std::vector<idle_client> idle;
+    size_t count = 0;
+    std::deque<std::weak_ptr<pool_waiter>> waiters;
+  };
+
+  // shared with the handed out connections, they may outlive the pool.
+  struct pool_state {
+    explicit pool_state(client_pool_config cfg)
+        : config(std::move(cfg)), timer(get_global_executor()) {}
+
+    client_pool_config config;
+    std::mutex mtx;
+    std::unordered_map<std::string, endpoint_pool> endpoints;
+    asio::steady_timer timer;
+    bool stopped = false;
+  };
+
+  static asio::awaitable<std::error_code>
+  connect(rpc_client &client, std::string_view address,
+          const client_pool_config &config) {
+    client.enable_multiplexing(config.enable_multiplexing);
+    co_return co_await client.connect(address, config.connect_timeout);
+  }
+
+  // a wakeup is only taken by a waiter which is still waiting, the one which
+  // has timed out will check the pool again by itself.
+  static void wake_one(endpoint_pool &endpoint) {
+    while (!endpoint.waiters.empty()) {
+      auto waiter = endpoint.waiters.front().lock();
+      endpoint.waiters.pop_front();
+      if (waiter && waiter->waiting) {
+        waiter->waiting = false;
+        // it may not be waiting yet, so it is expired rather than cancelled.
+        asio::dispatch(waiter->timer.get_executor(), [waiter] {
+          waiter->timer.expires_at(
+              std::chrono::steady_clock::time_point::min());
+        });
+        return;
+      }
+    }
+  }
+
+  static void wake_all(endpoint_pool &endpoint) {
+    while (!endpoint.waiters.empty()) {
+      wake_one(endpoint);
+    }
+  }
+
+  static std::shared_ptr<rpc_client>
+  make_handle(std::shared_ptr<pool_state> state, std::string address,
+              std::unique_ptr<rpc_client> client) {
+    std::weak_ptr<pool_state> weak(state);
+    return std::shared_ptr<rpc_client>(
+        client.release(), [weak, address = std::move(address)](
+                              rpc_client *ptr) {
+          std::unique_ptr<rpc_client> client(ptr);
+          auto state = weak.lock();
+          if (!state) {
+            return;
+          }
+          std::scoped_lock lock(state->mtx);
+          auto &endpoint = state->endpoints[address];
+          if (state->stopped || client->has_closed()) {
+            endpoint.count--;
+          } else {
+            endpoint.idle.push_back(
+                {std::move(client), std::chrono::steady_clock::now()});
+          }
+          wake_one(endpoint);
+        });
+  }
+
+  static asio::awaitable<void> check_idle(std::shared_ptr<pool_state> state) {
+    while (true) {
+      state->timer.expires_after(state->config.check_interval);
+      auto [ec] = co_await state->timer.async_wait(
+          asio::as_tuple(asio::use_awaitable));
+      std::vector<std::pair<std::string, idle_client>> idle;
+      std::vector<std::unique_ptr<rpc_client>> expired;
+      {
+        std::scoped_lock lock(state->mtx);
+        if (ec || state->stopped) {
+          co_return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto &[address, endpoint] : state->endpoints) {
+          for (auto &conn : endpoint.idle) {
+            if (now - conn.since >= state->config.max_idle_time) {
+              expired.push_back(std::move(conn.client));
+              endpoint.count--;
+              wake_one(endpoint);
+            } else {
+              idle.emplace_back(address, std::move(conn));
+            }
+          }
+          endpoint.idle.clear();
+        }
+      }
+
+      // the socket of a client is only touched in its executor, the idle ones
+      // are out of the pool while they are probed.
+      for (auto &[address, conn] : idle) {
+        auto executor = conn.client->get_executor();
+        asio::co_spawn(executor,
+                       probe(state, std::move(address), std::move(conn)),
+                       asio::detached);
+      }
+    }
+  }
+
+  static asio::awaitable<void> probe(std::shared_ptr<pool_state> state,
+                                     std::string address, idle_client conn) {
+    if (!conn.client->probe()) {
+      co_await reconnect(state, std::move(address), std::move(conn.client));
+      co_return;
+    }
+    std::scoped_lock lock(state->mtx);
+    auto &endpoint = state->endpoints[address];
+    if (state->stopped) {
+      endpoint.count--;
+    } else {
+      endpoint.idle.push_back(std::move(conn));
+    }
+    wake_one(endpoint);
+  }
+
+  // the broken connection is still counted until it is reconnected or
+  // dropped.
+  static asio::awaitable<void> reconnect(std::shared_ptr<pool_state> state,
+                                         std::string address,
+                                         std::unique_ptr<rpc_client> client) {
+    auto ec = co_await connect(*client, address, state->config);
+    std::scoped_lock lock(state->mtx);
+    auto &endpoint = state->endpoints[address];
+    if (ec || state->stopped) {
+      endpoint.count--;
+    } else {
+      endpoint.idle.push_back(
+          {std::move(client), std::chrono::steady_clock::now()});
+    }
+    wake_one(endpoint);
+  }
+
+  std::shared_ptr<pool_state> state_;
+};
+} // namespace rest_rpc
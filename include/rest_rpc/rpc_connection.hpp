@@ -1,27 +1,85 @@
 #pragma once
+#include "io_context_pool.hpp"
 #include "logger.hpp"
+#include "read_buffer.hpp"
 #include "rest_rpc_protocol.hpp"
 #include "rpc_router.hpp"
 #include "string_resize.hpp"
+#include "timing_wheel.hpp"
 #include "use_asio.hpp"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <span>
+#include <unordered_set>
 
 namespace rest_rpc {
 class rpc_connection;
 
+// the state of the request which is being routed, rpc_context takes the
+// seq_num from it and marks it delayed.
+struct request_state {
+  uint64_t seq_num = 0;
+  serialize_type type = serialize_type::rest;
+  bool delay = false;
+  // set by the cancel frame of the client in the io thread, it is not
+  // responded. An offloaded handler reads it in a pool thread.
+  std::atomic<bool> cancelled = false;
+  std::string_view req_attachment;
+  std::string resp_attachment;
+};
+
 class tls_data {
 public:
   void set_connection(std::shared_ptr<rpc_connection> conn) { conn_ = conn; }
 
-  bool delay() { return delay_; }
+  void set_request(std::shared_ptr<request_state> req) {
+    req_ = std::move(req);
+  }
+
+  bool delay() { return req_ && req_->delay; }
+
+  void set_delay(bool r) {
+    if (req_) {
+      req_->delay = r;
+    }
+  }
+
+  uint64_t seq_num() { return req_ ? req_->seq_num : 0; }
+
+  rest_rpc::serialize_type serialize_type() {
+    return req_ ? req_->type : serialize_type::rest;
+  }
+
+  // the attachment of the request, it refers to the receive buffer and is
+  // only valid until the handler returns, a coroutine handler should get it
+  // before the first co_await.
+  std::string_view request_attachment() {
+    return req_ ? req_->req_attachment : std::string_view{};
+  }
+
+  // the attachment is moved in and sent after the response by
+  // scatter/gather without another copy.
+  void set_response_attachment(std::string &&attachment) {
+    if (req_) {
+      req_->resp_attachment = std::move(attachment);
+    }
+  }
 
-  void set_delay(bool r) { delay_ = r; }
+  // whether the client has cancelled the request, only in concurrent mode. A
+  // coroutine handler should keep the request before the first co_await and
+  // check its cancelled flag.
+  bool is_cancelled() {
+    return req_ && req_->cancelled.load(std::memory_order::acquire);
+  }
+  std::shared_ptr<request_state> request() { return req_; }
 
   auto get_executor();
   std::shared_ptr<rpc_connection> get_conn() { return conn_; }
 
 private:
   std::shared_ptr<rpc_connection> conn_ = nullptr;
-  bool delay_ = false;
+  std::shared_ptr<request_state> req_ = nullptr;
 };
 
 inline auto &get_context() {
@@ -41,12 +99,30 @@ public:
   template <typename... Args>
   asio::awaitable<std::error_code> response(Args &&...args);
 
+  void set_response_attachment(std::string &&attachment) {
+    resp_attachment_ = std::move(attachment);
+  }
+
 private:
   asio::any_io_executor executor_;
   std::shared_ptr<rpc_connection> conn_ = nullptr;
+  uint64_t seq_num_ = 0;
+  serialize_type type_ = serialize_type::rest;
+  std::string resp_attachment_;
   bool has_response_ = false;
 };
 
+// what to do with a published message when the publish queue of a
+// subscriber is full.
+enum class overflow_policy {
+  drop_oldest,
+  drop_newest,
+  disconnect,
+  // keep only the latest queued message of each topic, the oldest message is
+  // dropped if the queue is still full.
+  conflate,
+};
+
 class rpc_connection : public std::enable_shared_from_this<rpc_connection> {
 public:
   rpc_connection(tcp_socket socket, uint64_t conn_id, rpc_router &router,
@@ -54,63 +130,130 @@ public:
       : socket_(std::move(socket)), conn_id_(conn_id), router_(router),
         cross_ending_(cross_ending) {}
 
+  ~rpc_connection() {
+    if (load_) {
+      load_->connections.fetch_sub(1, std::memory_order::relaxed);
+    }
+  }
+
+  // the load of the io_context which the connection is placed on, it counts
+  // the connection and its requests.
+  void set_load(std::shared_ptr<context_load> load) {
+    load_ = std::move(load);
+    load_->connections.fetch_add(1, std::memory_order::relaxed);
+  }
+
   asio::awaitable<void> start() {
     rest_rpc_header header;
+    size_t frame_size = 0;
     auto self = this->shared_from_this();
+    if (wheel_) {
+      last_tick_ = wheel_->now();
+      wheel_->add(self);
+    }
     while (true) {
+      // the previous frame has been handled.
+      read_buf_.consume(std::exchange(frame_size, 0));
+
       std::error_code ec;
-      size_t size;
-      set_last_time();
-      std::tie(ec, size) = co_await asio::async_read(
-          socket_, asio::buffer(&header, sizeof(rest_rpc_header)),
-          asio::as_tuple(asio::use_awaitable));
-      if (ec) {
-        if (ec != asio::error::eof) {
-          REST_LOG_INFO << "read head error: " << ec.message();
-        } else {
-          REST_LOG_INFO << "read head error: " << ec.message();
-        }
+      auto status = parse_frame(header);
+      if (status == frame_status::error) {
+        REST_LOG_ERROR << "protocol error";
         close();
         break;
       }
 
-      if (cross_ending_) {
-        parse_recieved(header);
-      }
+      if (status == frame_status::need_more) {
+        size_t need = sizeof(rest_rpc_header);
+        if (read_buf_.size() >= sizeof(rest_rpc_header)) {
+          need += header.body_len + header.attach_length;
+        }
+        need -= (std::min)(need, read_buf_.size());
 
-      if (header.magic != REST_MAGIC_NUM) {
-        REST_LOG_ERROR << "protocol error";
-        break;
+        size_t size;
+        set_last_time();
+        std::tie(ec, size) = co_await socket_.async_read_some(
+            read_buf_.prepare((std::max)(need, read_ahead_size)),
+            asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+          if (ec != asio::error::eof) {
+            REST_LOG_INFO << "read error: " << ec.message();
+          } else {
+            REST_LOG_INFO << "read error: " << ec.message();
+          }
+          close();
+          break;
+        }
+        read_buf_.commit(size);
+        continue;
       }
 
-      if (header.msg_type == 1) { // pub sub
+      frame_size =
+          sizeof(rest_rpc_header) + header.body_len + header.attach_length;
+      auto payload = read_buf_.data().substr(sizeof(rest_rpc_header),
+                                             frame_size -
+                                                 sizeof(rest_rpc_header));
+      auto body = payload.substr(0, header.body_len);
+
+      if (header.msg_type == 1) { // subscribe
         topic_id_ = header.function_id;
+        if (topics_.insert(header.function_id).second && sub_cb_) {
+          sub_cb_(header.function_id, true);
+        }
+        continue;
+      }
+      if (header.msg_type == 2) { // unsubscribe
+        if (topics_.erase(header.function_id) > 0 && sub_cb_) {
+          sub_cb_(header.function_id, false);
+        }
+        continue;
+      }
+      if (header.msg_type == 3) { // cancel
+        if (auto it = running_.find(header.seq_num); it != running_.end()) {
+          it->second->cancelled.store(true, std::memory_order::release);
+        }
         continue;
       }
 
-      detail::resize(body_, header.body_len);
+      if (load_) {
+        load_->requests.fetch_add(1, std::memory_order::relaxed);
+      }
 
-      if (header.body_len > 0) {
-        set_last_time();
-        std::tie(ec, size) = co_await asio::async_read(
-            socket_, asio::buffer(body_), asio::as_tuple(asio::use_awaitable));
-        if (ec) {
-          REST_LOG_WARNING << "read body error: " << ec.message();
-          close();
-          break;
+      if (max_concurrency_ > 0) {
+        if (inflight_ >= max_concurrency_) {
+          co_await slot_event_.wait();
         }
+        inflight_++;
+        asio::co_spawn(socket_.get_executor(),
+                       handle_request(header, std::string(payload)),
+                       asio::detached);
+        continue;
       }
 
       // route
+      req_->seq_num = header.seq_num;
+      req_->type = serialize_type(header.serialize_type);
+      req_->delay = false;
+      req_->req_attachment = payload.substr(header.body_len);
+      req_->resp_attachment.clear();
       get_context().set_connection(self);
-      auto result = co_await router_.route(header.function_id, body_);
-      bool delay = get_context().delay();
-      if (delay) {
-        get_context().set_delay(false);
+      get_context().set_request(req_);
+      // the non-awaitable handlers are called in place.
+      rpc_result result;
+      if (!router_.try_route(header.function_id, body, req_->type, result)) {
+        if (router_.is_offload(header.function_id)) {
+          result = co_await offload(header.function_id, body, req_);
+        } else {
+          result =
+              co_await router_.route(header.function_id, body, req_->type);
+        }
+      }
+      if (req_->delay) {
         continue;
       }
 
-      ec = co_await response(result);
+      ec = co_await response(result, 0, header.seq_num,
+                             req_->resp_attachment);
       if (ec) {
         REST_LOG_WARNING << "write error: " << ec.message();
         break;
@@ -118,37 +261,120 @@ public:
     }
   }
 
-  asio::awaitable<std::error_code> response(const rpc_result &result,
-                                            uint32_t func_id = 0) {
-    rest_rpc_header resp_header{};
-    resp_header.magic = 39;
-    if (func_id != 0) {
-      resp_header.msg_type = 1;
-      resp_header.function_id = func_id;
+  asio::awaitable<std::error_code>
+  response(const rpc_result &result, uint32_t func_id = 0,
+           uint64_t seq_num = 0, std::string_view attachment = {}) {
+    if (co_await asio::this_coro::executor != socket_.get_executor()) {
+      // the send queue is only touched in the connection executor.
+      co_return co_await asio::co_spawn(
+          socket_.get_executor(),
+          response(result, func_id, seq_num, attachment),
+          asio::use_awaitable);
     }
-    resp_header.body_len = result.size() + 1;
-    if (cross_ending_) {
-      prepare_for_send(resp_header);
+
+    send_frame frame = make_frame(result, func_id, seq_num, attachment);
+    co_return co_await send_frames(std::span<send_frame>(&frame, 1));
+  }
+
+  // only for concurrent mode, the max number of requests being handled at the
+  // same time per connection, 0 means handling the requests one by one.
+  void set_max_concurrency(size_t n) { max_concurrency_ = n; }
+
+  // the max length of the body and the attachment of a request, the
+  // connection is closed when a longer one arrives.
+  void set_max_frame_length(uint64_t n) { max_frame_length_ = n; }
+
+  uint64_t id() const { return conn_id_; }
+  auto get_executor() { return socket_.get_executor(); }
+  // the max number of the published messages waiting to be sent, 0 means
+  // unbounded. It must be called in the connection executor, the messages
+  // over the new limit are dropped by the policy.
+  void set_publish_queue_limit(size_t limit, overflow_policy policy) {
+    pub_limit_ = limit;
+    pub_policy_ = policy;
+    if (limit == 0 || pub_queue_.size() <= limit) {
+      return;
     }
-    std::vector<asio::const_buffer> buffers;
-    buffers.reserve(3);
-    buffers.push_back(asio::buffer(&resp_header, sizeof(rest_rpc_header)));
-    buffers.push_back(asio::buffer(&result.ec, 1));
-    if (!result.empty())
-      buffers.push_back(asio::buffer(result.data()));
 
-    set_last_time();
-    auto [ec, size] = co_await asio::async_write(
-        socket_, buffers, asio::as_tuple(asio::use_awaitable));
-    if (ec) {
-      REST_LOG_WARNING << "write error: " << ec.message();
+    size_t dropped = pub_queue_.size() - limit;
+    if (policy == overflow_policy::disconnect) {
+      REST_LOG_WARNING << "publish queue is full, close connection, id "
+                       << conn_id_;
+      dropped = pub_queue_.size();
+      pub_queue_.clear();
       close();
+    } else if (policy == overflow_policy::drop_newest) {
+      pub_queue_.resize(limit);
+    } else {
+      pub_queue_.erase(pub_queue_.begin(), pub_queue_.begin() + dropped);
     }
-    co_return ec;
+    dropped_.fetch_add(dropped, std::memory_order::relaxed);
   }
 
-  uint64_t id() const { return conn_id_; }
-  auto get_executor() { return socket_.get_executor(); }
+  // Queue a published message, it is sent after the messages queued before
+  // it, it must be called in the connection executor. Returns the number of
+  // the messages dropped by the overflow policy.
+  size_t publish(uint32_t topic_id, std::shared_ptr<const rpc_result> msg) {
+    if (has_closed_) {
+      return 0;
+    }
+
+    size_t dropped = 0;
+    if (pub_policy_ == overflow_policy::conflate) {
+      auto it = std::find_if(
+          pub_queue_.begin(), pub_queue_.end(),
+          [topic_id](const auto &pub) { return pub.topic_id == topic_id; });
+      if (it != pub_queue_.end()) {
+        it->msg = std::move(msg);
+        dropped++;
+      }
+    }
+
+    if (msg) {
+      if (pub_limit_ > 0 && pub_queue_.size() >= pub_limit_) {
+        dropped++;
+        switch (pub_policy_) {
+        case overflow_policy::drop_newest:
+          msg = nullptr;
+          break;
+        case overflow_policy::disconnect:
+          REST_LOG_WARNING << "publish queue is full, close connection, id "
+                           << conn_id_;
+          pub_queue_.clear();
+          close();
+          msg = nullptr;
+          break;
+        default:
+          pub_queue_.pop_front();
+          break;
+        }
+      }
+      if (msg) {
+        pub_queue_.push_back({topic_id, std::move(msg)});
+      }
+    }
+
+    if (dropped > 0) {
+      dropped_.fetch_add(dropped, std::memory_order::relaxed);
+    }
+    if (!pub_writing_ && !pub_queue_.empty()) {
+      pub_writing_ = true;
+      asio::co_spawn(socket_.get_executor(),
+                     send_published(shared_from_this()), asio::detached);
+    }
+    return dropped;
+  }
+
+  // the number of the published messages dropped by the overflow policy.
+  uint64_t dropped_messages() const {
+    return dropped_.load(std::memory_order::relaxed);
+  }
+
+  // the subscribed topics, only touched in the connection executor.
+  const std::unordered_set<uint32_t> &topics() const { return topics_; }
+
+  // the last subscribed topic, a connection may subscribe several topics, see
+  // topics().
   uint32_t topic_id() const { return topic_id_; }
 
   void
@@ -156,6 +382,13 @@ public:
     quit_cb_ = std::move(callback);
   }
 
+  // called when a topic is subscribed or unsubscribed, the topics left are
+  // unsubscribed when the connection is closed.
+  void set_subscribe_callback(
+      std::function<void(uint32_t topic_id, bool subscribed)> callback) {
+    sub_cb_ = std::move(callback);
+  }
+
   void close(bool need_cb = true) {
     if (has_closed_) {
       return;
@@ -167,6 +400,12 @@ public:
       socket_.shutdown(asio::socket_base::shutdown_both, ec);
       socket_.close(ec);
       REST_LOG_INFO << "close connection, id " << conn_id_;
+      if (sub_cb_) {
+        for (auto topic_id : topics_) {
+          sub_cb_(topic_id, false);
+        }
+      }
+      topics_.clear();
       if (need_cb && quit_cb_) {
         quit_cb_(conn_id_);
       }
@@ -175,30 +414,276 @@ public:
   }
 
   void set_last_time() {
-    if (checkout_timeout_) {
+    if (wheel_) {
+      last_tick_ = wheel_->now();
+    } else if (checkout_timeout_) {
       last_rwtime_ = std::chrono::system_clock::now();
     }
   }
 
   asio::awaitable<std::chrono::system_clock::time_point> get_last_rwtime() {
     co_await asio::this_coro::executor;
+    if (wheel_) {
+      co_return std::chrono::system_clock::now() -
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              std::chrono::steady_clock::now() - wheel_->time_of(last_tick_));
+    }
     co_return last_rwtime_;
   }
 
   void set_check_timeout(bool r) { checkout_timeout_ = r; }
 
+  // the idle connection is closed by the timing wheel of its io_context, it
+  // should be set before start.
+  void set_timing_wheel(timing_wheel<rpc_connection> *wheel) { wheel_ = wheel; }
+
+  // the tick of the last read or write, only for the timing wheel.
+  uint64_t last_tick() const { return last_tick_; }
+
+  bool has_closed() const { return has_closed_; }
+
 private:
+  enum class frame_status { ready, need_more, error };
+
+  // the queued messages are taken in batches and each batch is sent in one
+  // write, the queued ones can be dropped until they are taken by the writer.
+  static asio::awaitable<void>
+  send_published(std::shared_ptr<rpc_connection> self) {
+    std::vector<published> batch;
+    std::vector<send_frame> frames;
+    while (!self->pub_queue_.empty() && !self->has_closed_) {
+      size_t n = (std::min)(self->pub_queue_.size(), max_publish_batch);
+      batch.assign(std::make_move_iterator(self->pub_queue_.begin()),
+                   std::make_move_iterator(self->pub_queue_.begin() + n));
+      self->pub_queue_.erase(self->pub_queue_.begin(),
+                             self->pub_queue_.begin() + n);
+      frames.clear();
+      for (auto &pub : batch) {
+        frames.push_back(self->make_frame(*pub.msg, pub.topic_id, 0, {}));
+      }
+      auto ec = co_await self->send_frames(frames);
+      if (ec) {
+        break;
+      }
+    }
+    self->pub_writing_ = false;
+  }
+
+  // check whether a complete frame is in the read buffer, the header is
+  // filled as soon as it has been received.
+  frame_status parse_frame(rest_rpc_header &header) {
+    auto data = read_buf_.data();
+    if (data.size() < sizeof(rest_rpc_header)) {
+      return frame_status::need_more;
+    }
+
+    std::memcpy(&header, data.data(), sizeof(rest_rpc_header));
+    if (cross_ending_) {
+      parse_recieved(header);
+    }
+
+    if (header.magic != REST_MAGIC_NUM) {
+      return frame_status::error;
+    }
+    if (!valid_lengths(header, max_frame_length_)) {
+      REST_LOG_WARNING << "frame longer than " << max_frame_length_
+                       << ", id " << conn_id_;
+      return frame_status::error;
+    }
+
+    if (data.size() - sizeof(rest_rpc_header) <
+        header.body_len + header.attach_length) {
+      return frame_status::need_more;
+    }
+    return frame_status::ready;
+  }
+
+  asio::awaitable<void> handle_request(rest_rpc_header header,
+                                       std::string payload) {
+    auto self = shared_from_this();
+    auto req = std::make_shared<request_state>();
+    std::string_view body(payload.data(), header.body_len);
+    req->seq_num = header.seq_num;
+    req->type = serialize_type(header.serialize_type);
+    req->req_attachment = std::string_view(payload).substr(header.body_len);
+    if (header.seq_num != 0) {
+      running_[header.seq_num] = req;
+    }
+    get_context().set_connection(self);
+    get_context().set_request(req);
+    rpc_result result;
+    if (!router_.try_route(header.function_id, body, req->type, result)) {
+      if (router_.is_offload(header.function_id)) {
+        result = co_await offload(header.function_id, body, req);
+      } else {
+        result = co_await router_.route(header.function_id, body, req->type);
+      }
+    }
+    if (!req->delay && !req->cancelled.load(std::memory_order::acquire)) {
+      co_await response(result, 0, header.seq_num, req->resp_attachment);
+    }
+    running_.erase(header.seq_num);
+
+    if (inflight_-- == max_concurrency_) {
+      slot_event_.notify();
+    }
+  }
+
+  // route the request in the offload pool, the caller is resumed in its own
+  // executor when it is done.
+  asio::awaitable<rpc_result> offload(uint32_t key, std::string_view body,
+                                      std::shared_ptr<request_state> req) {
+    return asio::co_spawn(
+        router_.get_offload_executor(),
+        [this, self = shared_from_this(), key, body,
+         req = std::move(req)]() -> asio::awaitable<rpc_result> {
+          get_context().set_connection(self);
+          get_context().set_request(req);
+          co_return co_await router_.route(key, body, req->type);
+        },
+        asio::use_awaitable);
+  }
+
+  struct send_frame {
+    rest_rpc_header header;
+    rpc_errc ec;
+    std::string_view body;
+    std::string_view attachment;
+    wait_event event{};
+    bool done = false;
+    std::error_code write_ec{};
+  };
+
+  send_frame make_frame(const rpc_result &result, uint32_t func_id,
+                        uint64_t seq_num, std::string_view attachment) {
+    rest_rpc_header header{};
+    header.magic = 39;
+    header.serialize_type = uint8_t(result.type);
+    if (func_id != 0) {
+      header.msg_type = 1;
+      header.function_id = func_id;
+    }
+    header.seq_num = seq_num;
+    header.body_len = result.size() + 1;
+    header.attach_length = attachment.size();
+    if (cross_ending_) {
+      prepare_for_send(header);
+    }
+    return send_frame{header, result.ec, result.data(), attachment};
+  }
+
+  // The frames are queued together and written in the same write. If a
+  // writer is running they will be sent by it, or the socket is handed off
+  // to the first frame when the writer is done.
+  asio::awaitable<std::error_code> send_frames(std::span<send_frame> frames) {
+    for (auto &frame : frames) {
+      send_queue_.push_back(&frame);
+    }
+    auto &first = frames.front();
+    if (writing_) {
+      co_await first.event.wait();
+      if (first.done) {
+        co_return first.write_ec;
+      }
+    }
+
+    co_return co_await flush_send_queue();
+  }
+
+  // gather all the queued frames into one write, wake up the frames which
+  // have been sent and hand off the socket to the frames queued meanwhile.
+  asio::awaitable<std::error_code> flush_send_queue() {
+    writing_ = true;
+    auto *self_frame = send_queue_.front();
+    size_t count = send_queue_.size();
+    buffers_.clear();
+    for (auto *frame : send_queue_) {
+      buffers_.push_back(
+          asio::buffer(&frame->header, sizeof(rest_rpc_header)));
+      buffers_.push_back(asio::buffer(&frame->ec, 1));
+      if (!frame->body.empty()) {
+        buffers_.push_back(asio::buffer(frame->body));
+      }
+      if (!frame->attachment.empty()) {
+        buffers_.push_back(asio::buffer(frame->attachment));
+      }
+    }
+
+    set_last_time();
+    auto [ec, size] = co_await asio::async_write(
+        socket_, buffers_, asio::as_tuple(asio::use_awaitable));
+    if (ec) {
+      REST_LOG_WARNING << "write error: " << ec.message();
+      close();
+    }
+
+    std::vector<std::function<void()>> handlers;
+    for (size_t i = 0; i < count; i++) {
+      auto *frame = send_queue_.front();
+      send_queue_.pop_front();
+      if (frame == self_frame) {
+        continue;
+      }
+      frame->done = true;
+      frame->write_ec = ec;
+      // only the first frame of a batch waits.
+      if (auto handler = frame->event.take_handler()) {
+        handlers.push_back(std::move(handler));
+      }
+    }
+
+    if (send_queue_.empty()) {
+      writing_ = false;
+    } else {
+      send_queue_.front()->event.notify();
+    }
+
+    for (auto &handler : handlers) {
+      handler();
+    }
+    co_return ec;
+  }
+
+  inline static constexpr size_t read_ahead_size = 4096;
+  inline static constexpr size_t max_publish_batch = 64;
+
   tcp_socket socket_;
   uint64_t conn_id_;
-  std::string body_;
+  read_buffer read_buf_;
   std::function<void(const uint64_t &conn_id)> quit_cb_ = nullptr;
   std::atomic<bool> has_closed_{false};
   std::chrono::system_clock::time_point last_rwtime_ =
       std::chrono::system_clock::now();
   bool checkout_timeout_ = false;
+  timing_wheel<rpc_connection> *wheel_ = nullptr;
+  uint64_t last_tick_ = 0;
   rpc_router &router_;
   bool cross_ending_;
-  std::atomic<uint32_t> topic_id_;
+  std::shared_ptr<context_load> load_ = nullptr;
+  std::unordered_set<uint32_t> topics_;
+  std::atomic<uint32_t> topic_id_{0};
+  std::function<void(uint32_t topic_id, bool subscribed)> sub_cb_ = nullptr;
+  struct published {
+    uint32_t topic_id;
+    std::shared_ptr<const rpc_result> msg;
+  };
+  std::deque<published> pub_queue_;
+  bool pub_writing_ = false;
+  size_t pub_limit_ = 0;
+  overflow_policy pub_policy_ = overflow_policy::drop_oldest;
+  std::atomic<uint64_t> dropped_{0};
+  std::shared_ptr<request_state> req_ = std::make_shared<request_state>();
+
+  std::deque<send_frame *> send_queue_;
+  std::vector<asio::const_buffer> buffers_;
+  bool writing_ = false;
+
+  size_t max_concurrency_ = 0;
+  uint64_t max_frame_length_ = REST_DEFAULT_MAX_FRAME_LENGTH;
+  size_t inflight_ = 0;
+  // the requests being handled in concurrent mode, by seq_num.
+  std::unordered_map<uint64_t, std::shared_ptr<request_state>> running_;
+  wait_event slot_event_;
 };
 
 auto tls_data::get_executor() {
@@ -213,6 +698,8 @@ auto rpc_context::get_executor() { return executor_; }
 rpc_context::rpc_context() {
   executor_ = get_context().get_executor();
   conn_ = get_context().get_conn();
+  seq_num_ = get_context().seq_num();
+  type_ = get_context().serialize_type();
   get_context().set_delay(true);
 }
 
@@ -238,9 +725,11 @@ asio::awaitable<std::error_code> rpc_context::response(Args &&...args) {
     co_return make_error_code(rpc_errc::rpc_context_init_failed);
   }
 
-  rpc_result result(rpc_codec::pack_args(std::forward<Args>(args)...));
+  rpc_result result;
+  result = rpc_codec::pack_as(type_, std::forward<Args>(args)...);
+  result.type = type_;
   has_response_ = true;
-  co_return co_await conn_->response(result);
+  co_return co_await conn_->response(result, 0, seq_num_, resp_attachment_);
 }
 
 } // namespace rest_rpc
\ No newline at end of file
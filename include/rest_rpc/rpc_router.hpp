@@ -4,10 +4,14 @@
 
 #include "asio_util.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <functional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <unordered_set>
 
 namespace rest_rpc {
 template <typename T>
@@ -18,21 +22,42 @@ struct rpc_result {
   rpc_result(std::string str) : result(std::move(str)) {}
   rpc_result(std::string_view str) : view(str) {}
   rpc_result &operator=(std::string str) {
+    small.len = 0;
     result = std::move(str);
     return *this;
   }
   rpc_result &operator=(std::string_view str) {
+    small.len = 0;
     result = str;
     return *this;
   }
+  rpc_result &operator=(packed_args args) {
+    if (args.small.len > 0) {
+      small = args.small;
+    } else if (args.buf.empty()) {
+      result = args.view;
+    } else {
+      result = std::move(args.buf);
+    }
+    return *this;
+  }
   rpc_result() = default;
   rpc_errc ec = rpc_errc::ok;
+  // how the result is encoded, the same as the request's.
+  serialize_type type = serialize_type::rest;
   std::string result;
   std::string_view view;
-  bool empty() const { return result.empty() && view.empty(); }
-  size_t size() const { return result.empty() ? view.size() : result.size(); }
+  // the fixed-width result of the binary codec, it is sent from here.
+  inline_value small;
+  bool empty() const { return size() == 0; }
+  size_t size() const { return data().size(); }
 
-  std::string_view data() const { return result.empty() ? view : result; }
+  std::string_view data() const {
+    if (small.len > 0) {
+      return small.data();
+    }
+    return result.empty() ? view : result;
+  }
 };
 
 class rpc_router {
@@ -50,10 +75,68 @@ public:
     return register_handler(name, func, self);
   }
 
+  // Register a CPU-heavy handler, the connection runs it in the offload pool
+  // and resumes in its io thread when it is done, so the other connections of
+  // the io thread are not stalled.
+  template <typename Function, typename Self = void>
+  void register_offload_handler(std::string_view name, const Function &f,
+                                Self *self = nullptr) {
+    uint32_t key = MD5::MD5Hash32(name.data(), (uint32_t)name.length());
+    register_handler_impl(key, name, f, self, true);
+  }
+
+  template <auto func, typename Self = void>
+  void register_offload_handler(Self *self = nullptr) {
+    constexpr auto name = get_func_name<func>();
+    return register_offload_handler(name, func, self);
+  }
+
+  // the number of threads of the offload pool, it should be set before the
+  // first offloaded request.
+  void set_offload_threads(size_t n) { offload_threads_ = n; }
+
+  bool is_offload(uint32_t key) const {
+    return !offload_keys_.empty() && offload_keys_.contains(key);
+  }
+
+  auto get_offload_executor() {
+    std::call_once(offload_flag_, [this] {
+      offload_pool_ = std::make_unique<asio::thread_pool>(
+          (std::max)(offload_threads_, size_t(1)));
+    });
+    return offload_pool_->get_executor();
+  }
+
+  // Register a fixed set of free functions once, they are dispatched through a
+  // sorted table of function pointers built at compile time instead of the
+  // hash map, and can't be removed.
+  template <auto... funcs> void register_handlers() {
+    static_assert(sizeof...(funcs) > 0, "no handler to register");
+    static constexpr auto table = make_static_table<funcs...>();
+    if (!static_table_.empty()) {
+      throw std::invalid_argument("static handlers have been registered !");
+    }
+
+    constexpr std::array<std::pair<uint32_t, std::string_view>,
+                         sizeof...(funcs)>
+        names{std::pair{get_key<funcs>(), get_func_name<funcs>()}...};
+    for (auto &[key, name] : names) {
+      if (key2func_name_.find(key) != key2func_name_.end()) {
+        throw std::invalid_argument("duplicate registration key !");
+      }
+    }
+    for (auto &[key, name] : names) {
+      key2func_name_.emplace(key, name);
+    }
+    static_table_ = table;
+  }
+
   void remove_handler(std::string_view name) {
     uint32_t key = MD5::MD5Hash32(name.data(), (uint32_t)name.length());
-    this->map_invokers_.erase(key);
-    key2func_name_.erase(key);
+    if (this->map_invokers_.erase(key)) {
+      key2func_name_.erase(key);
+      offload_keys_.erase(key);
+    }
   }
 
   template <auto func> void remove_handler() {
@@ -69,17 +152,83 @@ public:
     return std::to_string(key);
   }
 
-  asio::awaitable<rpc_result> route(uint32_t key, std::string_view data) {
+  // Route the request to a non-awaitable handler without creating any
+  // coroutine frame, returns false if the handler is a coroutine or is
+  // offloaded, then the request should be routed by route().
+  bool try_route(uint32_t key, std::string_view data, serialize_type type,
+                 rpc_result &route_result) {
+    route_result.type = type;
+    try {
+      if (auto handler = find_static_handler(key)) {
+        if (!handler->sync) {
+          return false;
+        }
+        handler->sync(type, data, route_result);
+      } else {
+        auto it = map_invokers_.find(key);
+        if (it == map_invokers_.end()) {
+          route_result.result = "unknown function: " + get_name_by_key(key);
+          route_result.ec = rpc_errc::no_such_function;
+          return true;
+        }
+        if (!it->second.sync) {
+          return false;
+        }
+        it->second.sync(type, data, route_result);
+      }
+      route_result.ec = rpc_errc::ok;
+    } catch (...) {
+      set_exception(key, route_result);
+    }
+    return true;
+  }
+
+  asio::awaitable<rpc_result>
+  route(uint32_t key, std::string_view data,
+        serialize_type type = serialize_type::rest) {
     rpc_result route_result{};
+    if (try_route(key, data, type, route_result)) {
+      co_return route_result;
+    }
+
     try {
-      auto it = map_invokers_.find(key);
-      if (it == map_invokers_.end()) {
-        route_result.result = "unknown function: " + get_name_by_key(key);
-        route_result.ec = rpc_errc::no_such_function;
+      if (auto handler = find_static_handler(key)) {
+        co_await handler->async(type, data, route_result);
       } else {
-        co_await it->second(data, route_result);
-        route_result.ec = rpc_errc::ok;
+        co_await map_invokers_.at(key).async(type, data, route_result);
       }
+      route_result.ec = rpc_errc::ok;
+    } catch (...) {
+      set_exception(key, route_result);
+    }
+
+    co_return route_result;
+  }
+
+private:
+  using sync_invoker_t = void (*)(serialize_type, std::string_view,
+                                  rpc_result &);
+  using async_invoker_t = asio::awaitable<void> (*)(serialize_type,
+                                                     std::string_view,
+                                                     rpc_result &);
+  // only one of the invokers is set, by whether the handler is a coroutine.
+  struct static_handler {
+    uint32_t key;
+    sync_invoker_t sync;
+    async_invoker_t async;
+  };
+
+  struct handler_t {
+    std::function<void(serialize_type, std::string_view, rpc_result &)> sync;
+    std::function<asio::awaitable<void>(serialize_type, std::string_view,
+                                        rpc_result &)>
+        async;
+  };
+
+  // called in a catch block.
+  void set_exception(uint32_t key, rpc_result &route_result) {
+    try {
+      throw;
     } catch (const std::exception &ex) {
       route_result.result =
           std::string("exception occur when call").append(ex.what());
@@ -89,171 +238,225 @@ public:
                                 .append(get_name_by_key(key));
       route_result.ec = rpc_errc::function_unknown_exception;
     }
+  }
 
-    co_return route_result;
+  template <auto func> static constexpr static_handler make_static_handler() {
+    using R = typename util::function_traits<decltype(func)>::return_type;
+    if constexpr (is_awaitable_v<R>) {
+      return {get_key<func>(), nullptr, &invoke_static<func>};
+    } else {
+      return {get_key<func>(), &invoke_static_sync<func>, nullptr};
+    }
+  }
+
+  template <auto... funcs> static constexpr auto make_static_table() {
+    static_assert(
+        (!std::is_member_function_pointer_v<decltype(funcs)> && ...),
+        "only free functions can be registered statically");
+    std::array<static_handler, sizeof...(funcs)> table{
+        make_static_handler<funcs>()...};
+    std::sort(table.begin(), table.end(), [](auto &lhs, auto &rhs) {
+      return lhs.key < rhs.key;
+    });
+    for (size_t i = 1; i < table.size(); ++i) {
+      if (table[i - 1].key == table[i].key) {
+        throw std::invalid_argument("duplicate registration key !");
+      }
+    }
+    return table;
+  }
+
+  // returns the awaitable of the handler directly, no extra coroutine frame.
+  template <auto func>
+  static asio::awaitable<void> invoke_static(serialize_type type,
+                                             std::string_view str,
+                                             rpc_result &ret) {
+    static constexpr auto f = func;
+    return invoke(f, type, str, ret, (void *)nullptr);
+  }
+
+  template <auto func>
+  static void invoke_static_sync(serialize_type type, std::string_view str,
+                                 rpc_result &ret) {
+    invoke_sync(func, type, str, ret, (void *)nullptr);
+  }
+
+  const static_handler *find_static_handler(uint32_t key) const {
+    auto it = std::lower_bound(
+        static_table_.begin(), static_table_.end(), key,
+        [](const static_handler &h, uint32_t k) { return h.key < k; });
+    if (it != static_table_.end() && it->key == key) {
+      return &*it;
+    }
+    return nullptr;
   }
 
-private:
   template <typename Function, typename Self = void>
   void register_handler_impl(uint32_t key, std::string_view name,
-                             const Function &f, Self *self = nullptr) {
+                             const Function &f, Self *self = nullptr,
+                             bool offload = false) {
     if (key2func_name_.find(key) != key2func_name_.end()) {
       throw std::invalid_argument("duplicate registration key !");
     }
 
     key2func_name_.emplace(key, name);
 
-    register_func_impl(key, f, self);
+    register_func_impl(key, f, self, offload);
+    if (offload) {
+      offload_keys_.insert(key);
+    }
   }
 
   template <typename Function, typename Self>
-  void register_func_impl(uint32_t key, const Function &f, Self *self) {
-    this->map_invokers_[key] =
-        [this, f, self](std::string_view str,
-                        rpc_result &ret) -> asio::awaitable<void> {
-      using args_tuple =
-          typename util::function_traits<Function>::parameters_type;
-      using R = typename util::function_traits<Function>::return_type;
+  void register_func_impl(uint32_t key, const Function &f, Self *self,
+                          bool offload) {
+    using R = typename util::function_traits<Function>::return_type;
+    handler_t handler;
+    if constexpr (is_awaitable_v<R>) {
+      handler.async = [f, self](serialize_type type, std::string_view str,
+                                rpc_result &ret) -> asio::awaitable<void> {
+        co_await invoke(f, type, str, ret, self);
+      };
+    } else if (offload) {
+      // routed by route() in the offload pool.
+      handler.async = [f, self](serialize_type type, std::string_view str,
+                                rpc_result &ret) -> asio::awaitable<void> {
+        invoke_sync(f, type, str, ret, self);
+        co_return;
+      };
+    } else {
+      handler.sync = [f, self](serialize_type type, std::string_view str,
+                               rpc_result &ret) {
+        invoke_sync(f, type, str, ret, self);
+      };
+    }
+    this->map_invokers_[key] = std::move(handler);
+  }
+
+  // call the non-awaitable handler in place.
+  template <typename Function, typename Self>
+  static void invoke_sync(const Function &f, serialize_type type,
+                          std::string_view str, rpc_result &ret, Self *self) {
+    using args_tuple =
+        typename util::function_traits<Function>::parameters_type;
+    using R = typename util::function_traits<Function>::return_type;
+    auto call = [&f, self](auto &&...args) -> R {
+      if constexpr (std::is_void_v<Self>) {
+        return f(std::forward<decltype(args)>(args)...);
+      } else {
+        return (*self.*f)(std::forward<decltype(args)>(args)...);
+      }
+    };
+    auto call_with_args = [&]() -> R {
       if constexpr (std::tuple_size_v<args_tuple> == 0) {
-        co_await handle_zero_arg<R>(f, ret, self);
+        return call();
+      } else if constexpr (std::tuple_size_v<args_tuple> == 1 &&
+                           util::is_basic_v<
+                               std::tuple_element_t<0, args_tuple>>) {
+        return call(rpc_codec::unpack_as<std::tuple_element_t<0, args_tuple>>(
+            type, str));
       } else {
-        using first_t = std::tuple_element_t<0, args_tuple>;
-        if constexpr (std::tuple_size_v<args_tuple> == 1 &&
-                      util::is_basic_v<first_t>) {
-          co_await handle_one_arg<R, first_t>(str, f, ret, self);
-        } else {
-          co_await handle_more_args<R, args_tuple>(str, f, ret, self);
-        }
+        auto tp = rpc_codec::unpack_as<args_tuple>(type, str);
+        return std::apply(call, tp);
       }
     };
+    if constexpr (std::is_void_v<R>) {
+      call_with_args();
+    } else {
+      ret = rpc_codec::pack_as(type, call_with_args());
+    }
+  }
+
+  // f must outlive the returned awaitable, the non-awaitable handlers are
+  // called by invoke_sync().
+  template <typename Function, typename Self>
+  static asio::awaitable<void> invoke(const Function &f, serialize_type type,
+                                      std::string_view str, rpc_result &ret,
+                                      Self *self) {
+    using args_tuple =
+        typename util::function_traits<Function>::parameters_type;
+    using R = typename util::function_traits<Function>::return_type;
+    static_assert(is_awaitable_v<R>, "only coroutine handlers are invoked");
+    if constexpr (std::tuple_size_v<args_tuple> == 0) {
+      return handle_zero_arg<R>(type, f, ret, self);
+    } else {
+      using first_t = std::tuple_element_t<0, args_tuple>;
+      if constexpr (std::tuple_size_v<args_tuple> == 1 &&
+                    util::is_basic_v<first_t>) {
+        return handle_one_arg<R, first_t>(type, str, f, ret, self);
+      } else {
+        return handle_more_args<R, args_tuple>(type, str, f, ret, self);
+      }
+    }
   }
 
   template <typename R, typename F, typename Self>
-  asio::awaitable<void> handle_zero_arg(const F &f, rpc_result &ret,
-                                        Self *self) {
+  static asio::awaitable<void> handle_zero_arg(serialize_type type,
+                                               const F &f, rpc_result &ret,
+                                               Self *self) {
     if constexpr (is_void_v<R>) {
       if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          co_await f();
-        } else {
-          f();
-        }
+        co_await f();
       } else {
-        if constexpr (is_awaitable_v<R>) {
-          co_await (*self.*f)();
-        } else {
-          (*self.*f)();
-        }
+        co_await (*self.*f)();
       }
     } else {
       if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(co_await f());
-        } else {
-          ret = rpc_codec::pack_args(f());
-        }
+        ret = rpc_codec::pack_as(type, co_await f());
       } else {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(co_await (*self.*f)());
-        } else {
-          ret = rpc_codec::pack_args((*self.*f)());
-        }
+        ret = rpc_codec::pack_as(type, co_await (*self.*f)());
       }
     }
-    co_return;
   }
 
   template <typename R, typename Arg, typename F, typename Self>
-  asio::awaitable<void> handle_one_arg(std::string_view str, const F &f,
-                                       rpc_result &ret, Self *self) {
+  static asio::awaitable<void> handle_one_arg(serialize_type type,
+                                              std::string_view str,
+                                              const F &f, rpc_result &ret,
+                                              Self *self) {
     if constexpr (is_void_v<R>) {
       if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          co_await f(rpc_codec::unpack<Arg>(str));
-        } else {
-          f(rpc_codec::unpack<Arg>(str));
-        }
+        co_await f(rpc_codec::unpack_as<Arg>(type, str));
       } else {
-        if constexpr (is_awaitable_v<R>) {
-          co_await (*self.*f)(rpc_codec::unpack<Arg>(str));
-        } else {
-          (*self.*f)(rpc_codec::unpack<Arg>(str));
-        }
+        co_await (*self.*f)(rpc_codec::unpack_as<Arg>(type, str));
       }
     } else {
       if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(co_await f(rpc_codec::unpack<Arg>(str)));
-        } else {
-          ret = rpc_codec::pack_args(f(rpc_codec::unpack<Arg>(str)));
-        }
+        ret = rpc_codec::pack_as(
+            type, co_await f(rpc_codec::unpack_as<Arg>(type, str)));
       } else {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(
-              co_await (*self.*f)(rpc_codec::unpack<Arg>(str)));
-        } else {
-          ret = rpc_codec::pack_args((*self.*f)(rpc_codec::unpack<Arg>(str)));
-        }
+        ret = rpc_codec::pack_as(
+            type, co_await (*self.*f)(rpc_codec::unpack_as<Arg>(type, str)));
       }
     }
-    co_return;
   }
 
   template <typename R, typename Args, typename F, typename Self>
-  asio::awaitable<void> handle_more_args(std::string_view str, const F &f,
-                                         rpc_result &ret, Self *self) {
-    auto tp = rpc_codec::unpack<Args>(str);
-    if constexpr (std::is_void_v<R>) {
+  static asio::awaitable<void> handle_more_args(serialize_type type,
+                                                std::string_view str,
+                                                const F &f, rpc_result &ret,
+                                                Self *self) {
+    auto tp = rpc_codec::unpack_as<Args>(type, str);
+    auto call = [self, &f](auto &&...args) {
       if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          co_await std::apply(f, tp);
-        } else {
-          std::apply(f, tp);
-        }
+        return f(std::forward<decltype(args)>(args)...);
       } else {
-        if constexpr (is_awaitable_v<R>) {
-          co_await std::apply(
-              [self, &f](auto &&...args) {
-                return (*self.*f)(std::forward<decltype(args)>(args)...);
-              },
-              tp);
-        } else {
-          std::apply(
-              [self, &f](auto &&...args) {
-                return (*self.*f)(std::forward<decltype(args)>(args)...);
-              },
-              tp);
-        }
+        return (*self.*f)(std::forward<decltype(args)>(args)...);
       }
+    };
+    if constexpr (is_void_v<R>) {
+      co_await std::apply(call, tp);
     } else {
-      if constexpr (std::is_void_v<Self>) {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(co_await std::apply(f, tp));
-        } else {
-          ret = rpc_codec::pack_args(std::apply(f, tp));
-        }
-      } else {
-        if constexpr (is_awaitable_v<R>) {
-          ret = rpc_codec::pack_args(co_await std::apply(
-              [self, &f](auto &&...args) {
-                return (*self.*f)(std::forward<decltype(args)>(args)...);
-              },
-              tp));
-        } else {
-          ret = rpc_codec::pack_args(std::apply(
-              [self, &f](auto &&...args) {
-                return (*self.*f)(std::forward<decltype(args)>(args)...);
-              },
-              tp));
-        }
-      }
+      ret = rpc_codec::pack_as(type, co_await std::apply(call, tp));
     }
-    co_return;
   }
 
-  std::unordered_map<uint32_t, std::function<asio::awaitable<void>(
-                                   std::string_view, rpc_result &)>>
-      map_invokers_;
+  std::unordered_map<uint32_t, handler_t> map_invokers_;
   std::unordered_map<uint32_t, std::string> key2func_name_;
+  std::span<const static_handler> static_table_;
+  std::unordered_set<uint32_t> offload_keys_;
+  size_t offload_threads_ = std::thread::hardware_concurrency();
+  std::once_flag offload_flag_;
+  std::unique_ptr<asio::thread_pool> offload_pool_;
 };
 } // namespace rest_rpc
\ No newline at end of file
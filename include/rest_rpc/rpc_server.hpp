@@ -11,8 +11,8 @@ public:
   rpc_server(std::string address,
              size_t num_thread = std::thread::hardware_concurrency())
       : io_context_pool_(num_thread),
-        acceptor_(io_context_pool_.get_io_context()),
-        check_timer_(io_context_pool_.get_io_context()) {
+        acceptor_(io_context_pool_.get_io_context(0)) {
+    init_per_context();
     size_t pos = address.find(':');
     if (pos != std::string::npos) {
       host_ = address.substr(0, pos);
@@ -23,26 +23,35 @@ public:
   rpc_server(std::string host, std::string port,
              size_t num_thread = std::thread::hardware_concurrency())
       : io_context_pool_(num_thread),
-        acceptor_(io_context_pool_.get_io_context()), host_(std::move(host)),
-        port_(std::move(port)),
-        check_timer_(io_context_pool_.get_io_context()) {}
+        acceptor_(io_context_pool_.get_io_context(0)), host_(std::move(host)),
+        port_(std::move(port)) {
+    init_per_context();
+  }
   ~rpc_server() { stop(); }
 
   std::error_code start() { return start_impl(false); }
 
   std::error_code async_start() { return start_impl(true); }
 
+  // the connections idle longer than dur are closed, it is checked every
+  // check_conn_interval by the timing wheel of each io thread. If they are
+  // set after start, the wheels are started or changed then, the connections
+  // accepted before the first call are not checked.
   void set_conn_max_age(std::chrono::steady_clock::duration dur) {
     if (dur > std::chrono::steady_clock::duration::zero()) {
-      need_check_ = true;
       timeout_duration_ = dur;
-      asio::co_spawn(check_timer_.get_executor(), start_check_timer(),
-                     asio::detached);
+      need_check_ = true;
+      if (started_) {
+        start_wheels();
+      }
     }
   }
 
   void set_check_conn_interval(std::chrono::steady_clock::duration dur) {
     check_duration_ = dur;
+    if (started_ && need_check_) {
+      start_wheels();
+    }
   }
 
   void stop() {
@@ -57,15 +66,30 @@ public:
         (void)acceptor_.cancel(ec);
         (void)acceptor_.close(ec);
       });
+      for (auto &acceptor : acceptors_) {
+        asio::dispatch(acceptor->get_executor(), [&acceptor]() {
+          asio::error_code ec;
+          (void)acceptor->cancel(ec);
+          (void)acceptor->close(ec);
+        });
+      }
 
-      stop_timer_ = true;
+      if (need_check_) {
+        for (auto &wheel : wheels_) {
+          wheel->stop();
+        }
+      }
       REST_LOG_INFO << "server stoping";
       {
-        std::scoped_lock lock(*conn_mtx_);
-        for (auto &conn : conns_) {
-          conn.second->close(false);
+        for (auto &shard : shards_) {
+          std::scoped_lock lock(shard->mtx);
+          for (auto &conn : shard->conns) {
+            conn.second->close(false);
+          }
+          shard->conns.clear();
         }
-        conns_.clear();
+        std::scoped_lock lock(topics_->mtx);
+        topics_->subscribers.clear();
       }
 
       io_context_pool_.stop();
@@ -89,33 +113,148 @@ public:
     router_.register_handler<func>(self);
   }
 
+  template <auto... funcs> void register_handlers() {
+    router_.register_handlers<funcs...>();
+  }
+
+  template <typename Function, typename Self = void>
+  void register_offload_handler(std::string_view name, const Function &f,
+                                Self *self = nullptr) {
+    router_.register_offload_handler(name, f, self);
+  }
+
+  template <auto func, typename Self = void>
+  void register_offload_handler(Self *self = nullptr) {
+    router_.register_offload_handler<func>(self);
+  }
+
+  // the number of threads which run the offloaded handlers.
+  void set_offload_threads(size_t n) { router_.set_offload_threads(n); }
+
   void remove_handler(std::string_view name) { router_.remove_handler(name); }
 
   template <auto func> void remove_handler() { router_.remove_handler<func>(); }
 
   void enable_tcp_no_delay(bool r) { tcp_no_delay_ = r; }
 
+  // how the new connections are placed on the io threads, it is ignored in
+  // reuse port mode.
+  void set_placement_policy(placement_policy policy) {
+    io_context_pool_.set_placement_policy(policy);
+  }
+
+  // pin the io threads to the cores, see io_context_pool::set_cpu_affinity.
+  void set_cpu_affinity(const std::vector<int> &cores) {
+    io_context_pool_.set_cpu_affinity(cores);
+  }
+
   void enable_cross_ending(bool r) { cross_ending_ = r; }
 
+  // Open one SO_REUSEPORT acceptor per io_context, the kernel balances the
+  // new connections among them and each connection stays in the io_context
+  // which accepted it. It should be set before start, and it is ignored where
+  // SO_REUSEPORT is not supported.
+  void enable_reuse_port(bool r) { reuse_port_ = r; }
+
+  // Handle the requests of one connection concurrently, each request runs in
+  // its own coroutine and the response is sent back with the request seq_num
+  // as soon as it is done, n is the max number of requests being handled at
+  // the same time per connection, 0 means handling the requests one by one.
+  void set_max_concurrent_requests(size_t n) { max_concurrent_requests_ = n; }
+
+  // The max length of the body and the attachment of a request, the default
+  // is REST_DEFAULT_MAX_FRAME_LENGTH. A connection sending a longer one is
+  // closed before anything is allocated for it. It should be set before
+  // start.
+  void set_max_frame_length(uint64_t n) { max_frame_length_ = n; }
+
   size_t connection_count() {
-    std::scoped_lock lock(*conn_mtx_);
-    return conns_.size();
+    size_t count = 0;
+    for (auto &shard : shards_) {
+      std::scoped_lock lock(shard->mtx);
+      count += shard->conns.size();
+    }
+    return count;
   }
 
+  // a copy of all the connections, for_each_connection doesn't copy.
   auto get_connections() {
-    std::scoped_lock lock(*conn_mtx_);
-    return conns_;
+    std::unordered_map<uint64_t, std::shared_ptr<rpc_connection>> conns;
+    for_each_connection(
+        [&conns](const auto &conn) { conns.emplace(conn->id(), conn); });
+    return conns;
+  }
+
+  // f is called with the lock of a shard held, it should not block or call
+  // the other methods of the server.
+  template <typename F> void for_each_connection(F &&f) {
+    for (auto &shard : shards_) {
+      std::scoped_lock lock(shard->mtx);
+      for (auto &[_, conn] : shard->conns) {
+        f(conn);
+      }
+    }
+  }
+
+  size_t subscriber_count(std::string_view topic) {
+    auto id = MD5::MD5Hash32(topic.data(), (uint32_t)topic.size());
+    std::scoped_lock lock(topics_->mtx);
+    auto it = topics_->subscribers.find(id);
+    return it == topics_->subscribers.end() ? 0 : it->second.size();
+  }
+
+  // The max number of the published messages queued per connection and what
+  // to do when it is full, the default is unbounded. It is also applied to
+  // the existing connections in their executors.
+  void set_publish_queue_limit(size_t limit,
+                               overflow_policy policy =
+                                   overflow_policy::drop_oldest) {
+    pub_limit_ = limit;
+    pub_policy_ = policy;
+    for_each_connection([limit, policy](const auto &conn) {
+      apply_publish_queue_limit(conn, limit, policy);
+    });
   }
 
+  // the number of the published messages dropped by the overflow policy.
+  uint64_t dropped_messages() const {
+    return topics_->dropped.load(std::memory_order::relaxed);
+  }
+
+  // Only the subscribers of the topic are visited, the message is serialized
+  // once and shared by all of them. The message is queued to each subscriber
+  // in its own executor, publish doesn't wait for the writes, so a slow
+  // subscriber doesn't delay the others.
   template <typename T>
   asio::awaitable<void> publish(std::string_view topic, T &&t) {
     auto id = MD5::MD5Hash32(topic.data(), (uint32_t)topic.size());
-    auto conns = get_connections();
-    for (auto &[_, conn] : conns) {
-      if (conn->topic_id() == id) {
-        co_await conn->response(rpc_codec::pack_args(std::forward<T>(t)), id);
+    std::vector<std::shared_ptr<rpc_connection>> conns;
+    {
+      std::scoped_lock lock(topics_->mtx);
+      auto it = topics_->subscribers.find(id);
+      if (it == topics_->subscribers.end()) {
+        co_return;
+      }
+      conns.reserve(it->second.size());
+      for (auto &[_, conn] : it->second) {
+        conns.push_back(conn);
       }
     }
+
+    // a string argument is packed as a view, the message owns a copy since
+    // it is sent after publish returns.
+    auto msg = std::make_shared<const rpc_result>(
+        std::string(rpc_codec::pack_args(std::forward<T>(t))));
+    for (auto &conn : conns) {
+      auto executor = conn->get_executor();
+      asio::dispatch(executor, [conn = std::move(conn), msg, id,
+                                index = std::weak_ptr<topic_index>(topics_)] {
+        size_t dropped = conn->publish(id, msg);
+        if (auto topics = index.lock(); topics && dropped > 0) {
+          topics->dropped.fetch_add(dropped, std::memory_order::relaxed);
+        }
+      });
+    }
   }
 
   template <typename T> void sync_publish(std::string_view topic, T &&t) {
@@ -124,7 +263,6 @@ public:
 
 private:
   std::error_code listen() {
-    using asio::ip::tcp;
     asio::error_code ec;
     asio::ip::tcp::resolver resolver(acceptor_.get_executor());
     auto endpoints = resolver.resolve(host_, port_, ec);
@@ -132,42 +270,114 @@ private:
       return ec;
     }
 
-    auto it = endpoints.begin();
+    auto endpoint = endpoints.begin()->endpoint();
+    ec = listen(acceptor_, endpoint);
+    if (ec || !use_reuse_port()) {
+      return ec;
+    }
+
+    // the same port for all, even if the port is chosen by the system.
+    endpoint = acceptor_.local_endpoint(ec);
+    if (ec) {
+      return ec;
+    }
+    for (size_t i = 1; i < io_context_pool_.size(); i++) {
+      auto acceptor = std::make_unique<asio::ip::tcp::acceptor>(
+          io_context_pool_.get_io_context(i));
+      ec = listen(*acceptor, endpoint);
+      if (ec) {
+        // release the port, the server is not started.
+        std::error_code ignore;
+        acceptor_.close(ignore);
+        for (auto &opened : acceptors_) {
+          opened->close(ignore);
+        }
+        acceptors_.clear();
+        return ec;
+      }
+      acceptors_.push_back(std::move(acceptor));
+    }
+    return ec;
+  }
 
-    auto endpoint = it->endpoint();
-    acceptor_.open(endpoint.protocol(), ec);
+  std::error_code listen(asio::ip::tcp::acceptor &acceptor,
+                         const asio::ip::tcp::endpoint &endpoint) {
+    using asio::ip::tcp;
+    asio::error_code ec;
+    acceptor.open(endpoint.protocol(), ec);
     if (ec) {
       return ec;
     }
 
 #ifdef __GNUC__
-    acceptor_.set_option(tcp::acceptor::reuse_address(true), ec);
+    acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
 #endif
-    acceptor_.bind(endpoint, ec);
+#ifdef SO_REUSEPORT
+    if (reuse_port_) {
+      acceptor.set_option(
+          asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true),
+          ec);
+    }
+#endif
+    acceptor.bind(endpoint, ec);
     if (ec) {
       std::error_code ignore;
-      acceptor_.cancel(ignore);
-      acceptor_.close(ignore);
+      acceptor.cancel(ignore);
+      acceptor.close(ignore);
       return ec;
     }
 #ifdef _MSC_VER
-    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
 #endif
-    acceptor_.listen(asio::socket_base::max_listen_connections, ec);
+    acceptor.listen(asio::socket_base::max_listen_connections, ec);
     if (ec) {
       std::error_code ignore;
-      acceptor_.cancel(ignore);
-      acceptor_.close(ignore);
+      acceptor.cancel(ignore);
+      acceptor.close(ignore);
       return ec;
     }
     return ec;
   }
 
-  asio::awaitable<void> accept() {
-    uint64_t conn_id = 0;
+  bool use_reuse_port() const {
+#ifdef SO_REUSEPORT
+    return reuse_port_ && io_context_pool_.size() > 1;
+#else
+    return false;
+#endif
+  }
+
+  // move an accepted socket to the io_context, it stays in its own one if
+  // the platform can't release the handle.
+  static bool move_socket(tcp_socket &socket, asio::io_context &ctx) {
+    std::error_code ec;
+    auto protocol = socket.local_endpoint(ec).protocol();
+    if (ec) {
+      return false;
+    }
+    auto executor = socket.get_executor();
+    auto handle = socket.release(ec);
+    if (ec) {
+      return false;
+    }
+    tcp_socket moved(ctx);
+    moved.assign(protocol, handle, ec);
+    if (ec) {
+      REST_LOG_WARNING << "move socket failed: " << ec.message();
+      socket = tcp_socket(executor);
+      std::error_code ignore;
+      socket.assign(protocol, handle, ignore);
+      return false;
+    }
+    socket = std::move(moved);
+    return true;
+  }
+
+  asio::awaitable<void> accept(asio::ip::tcp::acceptor &acceptor,
+                               size_t index) {
     while (true) {
-      tcp_socket socket(io_context_pool_.get_io_context());
-      auto [ec] = co_await acceptor_.async_accept(
+      tcp_socket socket(acceptor.get_executor());
+      auto [ec] = co_await acceptor.async_accept(
           socket, asio::as_tuple(asio::use_awaitable));
       if (ec == asio::error::operation_aborted ||
           ec == asio::error::bad_descriptor) {
@@ -175,43 +385,94 @@ private:
         co_return;
       }
 
+      // the io_context is chosen by the load when the connection arrives, not
+      // when the accept started waiting. With SO_REUSEPORT the connection
+      // stays in the io_context of the acceptor.
+      size_t ctx_index = index;
+      if (!use_reuse_port()) {
+        size_t placed = io_context_pool_.place_connection();
+        if (placed != index &&
+            move_socket(socket, io_context_pool_.get_io_context(placed))) {
+          ctx_index = placed;
+        }
+      }
+
       if (tcp_no_delay_) {
         socket.set_option(asio::ip::tcp::no_delay(true));
       }
 
       REST_LOG_INFO << "new connction comming...";
+      uint64_t conn_id = conn_id_.fetch_add(1, std::memory_order_relaxed);
       auto conn = std::make_shared<rpc_connection>(std::move(socket), conn_id,
                                                    router_, cross_ending_);
+      conn->set_load(io_context_pool_.get_load(ctx_index));
       if (need_check_) {
-        conn->set_check_timeout(true);
+        conn->set_timing_wheel(wheels_[ctx_index].get());
       }
-      std::weak_ptr<std::mutex> weak(conn_mtx_);
-      conn->set_quit_callback([this, weak](const uint64_t &id) {
-        auto mtx = weak.lock();
-        if (mtx) {
-          std::scoped_lock lock(*mtx);
-          if (!conns_.empty()) {
-            std::erase_if(conns_, [id](const auto &pair) {
-              if (pair.first == id) {
-                pair.second->close(false);
-                return true;
-              }
-
-              return false;
-            });
+      conn->set_max_concurrency(max_concurrent_requests_);
+      conn->set_max_frame_length(max_frame_length_);
+      size_t pub_limit = pub_limit_;
+      overflow_policy pub_policy = pub_policy_;
+      conn->set_publish_queue_limit(pub_limit, pub_policy);
+      auto &shard = shards_[ctx_index];
+      std::weak_ptr<conn_shard> weak(shard);
+      conn->set_quit_callback([weak](const uint64_t &id) {
+        if (auto shard = weak.lock()) {
+          std::scoped_lock lock(shard->mtx);
+          auto it = shard->conns.find(id);
+          if (it != shard->conns.end()) {
+            it->second->close(false);
+            shard->conns.erase(it);
           }
         }
       });
 
+      conn->set_subscribe_callback(
+          [index = std::weak_ptr<topic_index>(topics_),
+           weak_conn = std::weak_ptr<rpc_connection>(conn),
+           conn_id](uint32_t topic_id, bool subscribed) {
+            auto topics = index.lock();
+            if (!topics) {
+              return;
+            }
+            std::scoped_lock lock(topics->mtx);
+            if (subscribed) {
+              if (auto conn = weak_conn.lock()) {
+                topics->subscribers[topic_id].emplace(conn_id, conn);
+              }
+              return;
+            }
+            auto it = topics->subscribers.find(topic_id);
+            if (it != topics->subscribers.end()) {
+              it->second.erase(conn_id);
+              if (it->second.empty()) {
+                topics->subscribers.erase(it);
+              }
+            }
+          });
+
       {
-        std::scoped_lock lock(*conn_mtx_);
-        conns_.emplace(conn_id++, conn);
+        std::scoped_lock lock(shard->mtx);
+        shard->conns.emplace(conn_id, conn);
+      }
+      // changed before the connection was visible to set_publish_queue_limit.
+      if (pub_limit != pub_limit_ || pub_policy != pub_policy_) {
+        apply_publish_queue_limit(conn, pub_limit_, pub_policy_);
       }
 
       co_spawn(socket.get_executor(), conn->start(), asio::detached);
     }
   }
 
+  // posted, the connection may be closed by it and close takes the lock of
+  // its shard.
+  static void apply_publish_queue_limit(std::shared_ptr<rpc_connection> conn,
+                                        size_t limit, overflow_policy policy) {
+    asio::post(conn->get_executor(), [conn, limit, policy] {
+      conn->set_publish_queue_limit(limit, policy);
+    });
+  }
+
   std::error_code start_impl(bool async) {
     if (has_stop_.load(std::memory_order_acquire)) {
       return std::make_error_code(std::errc::operation_canceled);
@@ -224,13 +485,23 @@ private:
         return;
       }
 
+      if (need_check_) {
+        start_wheels();
+      }
+      started_ = true;
+
       thd_ = std::thread([this] { io_context_pool_.run(); });
 
+      for (size_t i = 0; i < acceptors_.size(); i++) {
+        asio::co_spawn(acceptors_[i]->get_executor(),
+                       accept(*acceptors_[i], i + 1), asio::detached);
+      }
       if (async) {
-        asio::co_spawn(acceptor_.get_executor(), accept(), asio::detached);
+        asio::co_spawn(acceptor_.get_executor(), accept(acceptor_, 0),
+                       asio::detached);
       } else {
-        auto future = asio::co_spawn(acceptor_.get_executor(), accept(),
-                                     asio::use_future);
+        auto future = asio::co_spawn(acceptor_.get_executor(),
+                                     accept(acceptor_, 0), asio::use_future);
         future.wait();
       }
     });
@@ -238,56 +509,67 @@ private:
     return ec;
   }
 
-  asio::awaitable<void> check_timeout() {
-    auto cur_time = std::chrono::system_clock::now();
-
-    {
-      std::scoped_lock lock(*conn_mtx_);
-      for (auto it = conns_.begin(); it != conns_.end();) {
-        if (cur_time - co_await it->second->get_last_rwtime() >
-            timeout_duration_) {
-          it->second->close(false);
-          conns_.erase(it++);
-        } else {
-          ++it;
-        }
-      }
+  void start_wheels() {
+    for (auto &wheel : wheels_) {
+      wheel->start(check_duration_, timeout_duration_);
     }
   }
 
-  asio::awaitable<void> start_check_timer() {
-    while (true) {
-      check_timer_.expires_after(check_duration_);
-      auto [ec] =
-          co_await check_timer_.async_wait(asio::as_tuple(asio::use_awaitable));
-      if (ec || stop_timer_) {
-        co_return;
-      }
-      co_await check_timeout();
+  // the timing wheel and the connection shard of each io_context.
+  void init_per_context() {
+    for (size_t i = 0; i < io_context_pool_.size(); i++) {
+      wheels_.push_back(std::make_unique<timing_wheel<rpc_connection>>(
+          io_context_pool_.get_io_context(i)));
+      shards_.push_back(std::make_shared<conn_shard>());
     }
   }
 
   io_context_pool io_context_pool_;
   std::thread thd_;
   asio::ip::tcp::acceptor acceptor_;
+  // the acceptors of the other io_contexts in reuse port mode.
+  std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors_;
+  std::atomic<uint64_t> conn_id_ = 0;
   std::string host_;
   std::string port_;
   std::once_flag start_flag_;
   std::once_flag stop_flag_;
   std::atomic<bool> has_stop_ = false;
-  std::unordered_map<uint64_t, std::shared_ptr<rpc_connection>> conns_;
+  // the connections of each io_context, the close callbacks only lock the
+  // shard of their own io_context.
+  struct conn_shard {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, std::shared_ptr<rpc_connection>> conns;
+  };
+  std::vector<std::shared_ptr<conn_shard>> shards_;
+  // topic id -> the subscribed connections, kept by the connections when they
+  // subscribe, unsubscribe or close.
+  struct topic_index {
+    std::mutex mtx;
+    std::unordered_map<
+        uint32_t,
+        std::unordered_map<uint64_t, std::shared_ptr<rpc_connection>>>
+        subscribers;
+    std::atomic<uint64_t> dropped{0};
+  };
+  std::shared_ptr<topic_index> topics_ = std::make_shared<topic_index>();
 
-  std::shared_ptr<std::mutex> conn_mtx_ = std::make_shared<std::mutex>();
   std::chrono::steady_clock::duration check_duration_ =
       std::chrono::seconds(12);
   std::chrono::steady_clock::duration timeout_duration_{
       std::chrono::seconds(10)};
-  asio::steady_timer check_timer_;
-  std::atomic<bool> stop_timer_ = false;
-  bool need_check_ = false;
+  // one per io_context, destroyed before io_context_pool_.
+  std::vector<std::unique_ptr<timing_wheel<rpc_connection>>> wheels_;
+  std::atomic<bool> need_check_ = false;
+  std::atomic<bool> started_ = false;
 
   rpc_router router_;
   bool tcp_no_delay_ = true;
   bool cross_ending_ = false;
+  bool reuse_port_ = false;
+  size_t max_concurrent_requests_ = 0;
+  uint64_t max_frame_length_ = REST_DEFAULT_MAX_FRAME_LENGTH;
+  std::atomic<size_t> pub_limit_ = 0;
+  std::atomic<overflow_policy> pub_policy_ = overflow_policy::drop_oldest;
 };
 } // namespace rest_rpc
\ No newline at end of file
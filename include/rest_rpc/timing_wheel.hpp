@@ -0,0 +1,122 @@
+#pragma once
+#include "use_asio.hpp"
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace rest_rpc {
+// A timing wheel of the idle connections of one io_context, it is only
+// touched in the thread of the io_context, so no lock is needed. The time is
+// counted by ticks, the connections record the cached tick instead of reading
+// the clock. Each tick only visits the connections of the current slot, the
+// expired ones are closed and the others are moved to the slot of their own
+// expiry, so the cost is O(expired) rather than O(connections).
+template <typename Conn> class timing_wheel {
+public:
+  explicit timing_wheel(asio::io_context &ctx)
+      : timer_(ctx), start_time_(std::chrono::steady_clock::now()),
+        slots_(max_ticks_ + 1) {}
+
+  // It may be called again to change the tick or the max age of a running
+  // wheel, the ages recorded so far are kept in ticks then.
+  void start(std::chrono::steady_clock::duration tick,
+             std::chrono::steady_clock::duration max_age) {
+    asio::dispatch(timer_.get_executor(), [this, tick, max_age] {
+      if (stopped_) {
+        return;
+      }
+      // the current tick keeps its time.
+      if (running_) {
+        start_time_ = time_of(now_) - now_ * tick;
+      } else {
+        start_time_ = std::chrono::steady_clock::now();
+      }
+      tick_ = tick;
+      max_ticks_ = (max_age + tick - std::chrono::steady_clock::duration(1)) /
+                   tick;
+      if (max_ticks_ == 0) {
+        max_ticks_ = 1;
+      }
+
+      // the connections are visited by the next tick and put in their slots.
+      std::vector<std::weak_ptr<Conn>> all;
+      for (auto &slot : slots_) {
+        std::move(slot.begin(), slot.end(), std::back_inserter(all));
+      }
+      slots_.assign(max_ticks_ + 1, {});
+      slots_[(now_ + 1) % slots_.size()] = std::move(all);
+
+      if (running_) {
+        // the wait of the old tick, run() waits again.
+        timer_.cancel();
+      } else {
+        running_ = true;
+        asio::co_spawn(timer_.get_executor(), run(), asio::detached);
+      }
+    });
+  }
+
+  void stop() {
+    asio::dispatch(timer_.get_executor(), [this] {
+      stopped_ = true;
+      timer_.cancel();
+    });
+  }
+
+  // the cached tick count.
+  uint64_t now() const { return now_; }
+
+  std::chrono::steady_clock::time_point time_of(uint64_t tick) const {
+    return start_time_ + tick * tick_;
+  }
+
+  // the connection is visited when it may have expired.
+  void add(std::weak_ptr<Conn> conn) {
+    slots_[(now_ + max_ticks_) % slots_.size()].push_back(std::move(conn));
+  }
+
+private:
+  asio::awaitable<void> run() {
+    std::vector<std::weak_ptr<Conn>> expiring;
+    while (!stopped_) {
+      timer_.expires_at(time_of(now_ + 1));
+      auto [ec] =
+          co_await timer_.async_wait(asio::as_tuple(asio::use_awaitable));
+      if (stopped_) {
+        co_return;
+      }
+      if (ec) {
+        // cancelled by start() to change the tick.
+        continue;
+      }
+
+      now_++;
+      expiring.clear();
+      std::swap(expiring, slots_[now_ % slots_.size()]);
+      for (auto &weak : expiring) {
+        auto conn = weak.lock();
+        if (!conn || conn->has_closed()) {
+          continue;
+        }
+        uint64_t last = conn->last_tick();
+        if (now_ - last >= max_ticks_) {
+          conn->close();
+        } else {
+          slots_[(last + max_ticks_) % slots_.size()].push_back(
+              std::move(weak));
+        }
+      }
+    }
+  }
+
+  asio::steady_timer timer_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::chrono::steady_clock::duration tick_{};
+  uint64_t max_ticks_ = 1;
+  uint64_t now_ = 0;
+  bool running_ = false;
+  bool stopped_ = false;
+  std::vector<std::vector<std::weak_ptr<Conn>>> slots_;
+};
+} // namespace rest_rpc
@@ -2,7 +2,9 @@
 
 #include "doctest/doctest.h"
 #include <asio/any_completion_handler.hpp>
+#include <rest_rpc/balanced_client.hpp>
 #include <rest_rpc/rpc_client.hpp>
+#include <rest_rpc/rpc_client_pool.hpp>
 #include <rest_rpc/rpc_server.hpp>
 #include <rest_rpc/traits.h>
 using namespace rest_rpc;
@@ -246,6 +248,70 @@ asio::awaitable<void> test_router() {
 
 TEST_CASE("test router") { sync_wait(test_router()); }
 
+asio::awaitable<void> test_static_router() {
+  rpc_router router;
+  router.register_handlers<add, echo, round1, add_coro, no_arg>();
+  CHECK_THROWS(router.register_handlers<foo>());
+  CHECK_THROWS(router.register_handler<add>());
+  CHECK(router.get_name_by_key(get_key<echo>()) == get_func_name<echo>());
+
+  auto args = rpc_codec::pack_args(1, 2);
+  auto r = co_await router.route(get_key<add>(), args);
+  CHECK(r.ec == rpc_errc::ok);
+  CHECK(rpc_codec::unpack<int>(r.data()) == 3);
+  auto r1 = co_await router.route(get_key<add_coro>(), args);
+  CHECK(rpc_codec::unpack<int>(r1.data()) == 3);
+  auto r2 = co_await router.route(get_key<echo>(), "test");
+  CHECK(r2.data() == "test");
+  auto r3 = co_await router.route(get_key<no_arg>(), "");
+  CHECK(r3.ec == rpc_errc::ok);
+  auto r4 = co_await router.route(get_key<foo>(), "test");
+  CHECK(r4.ec == rpc_errc::no_such_function);
+
+  // the static handlers can't be removed.
+  router.remove_handler<add>();
+  auto r5 = co_await router.route(get_key<add>(), args);
+  CHECK(r5.ec == rpc_errc::ok);
+
+  router.register_handler<foo>();
+  auto r6 = co_await router.route(get_key<foo>(), "test");
+  CHECK(r6.ec == rpc_errc::ok);
+}
+
+TEST_CASE("test static router") { sync_wait(test_static_router()); }
+
+TEST_CASE("test sync route") {
+  rpc_router router;
+  router.register_handler<add>();
+  router.register_handler<add_coro>();
+  router.register_handler<exception_func>();
+  router.register_handlers<echo, echo_coro>();
+
+  auto args = rpc_codec::pack_args(1, 2);
+  rpc_result r;
+  CHECK(router.try_route(get_key<add>(), args, serialize_type::rest, r));
+  CHECK(rpc_codec::unpack<int>(r.data()) == 3);
+  rpc_result r1;
+  CHECK(router.try_route(get_key<echo>(), "test", serialize_type::rest, r1));
+  CHECK(r1.data() == "test");
+  rpc_result r2;
+  CHECK(router.try_route(get_key<exception_func>(), "", serialize_type::rest,
+                         r2));
+  CHECK(r2.ec == rpc_errc::function_exception);
+  rpc_result r3;
+  CHECK(router.try_route(get_key<no_arg>(), "", serialize_type::rest, r3));
+  CHECK(r3.ec == rpc_errc::no_such_function);
+
+  // the coroutine handlers must be routed by route().
+  rpc_result r4;
+  CHECK(!router.try_route(get_key<add_coro>(), args, serialize_type::rest,
+                          r4));
+  CHECK(!router.try_route(get_key<echo_coro>(), "test", serialize_type::rest,
+                          r4));
+  auto r5 = sync_wait(router.route(get_key<echo_coro>(), "test"));
+  CHECK(r5.data() == "test");
+}
+
 asio::awaitable<void>
 get_last_rwtime_coro(std::shared_ptr<rpc_connection> conn) {
   conn->set_last_time();
@@ -286,7 +352,8 @@ TEST_CASE("test rpc_connection") {
   conn->set_check_timeout(true);
   asio::co_spawn(io_ctx, get_last_rwtime_coro(conn), asio::detached);
   io_ctx.run();
-  std::cout << "topic_id: " << conn->topic_id() << std::endl;
+  CHECK(conn->topics().empty());
+  CHECK(conn->topic_id() == 0);
   conn->close();
   io_ctx.stop();
 }
@@ -296,6 +363,83 @@ TEST_CASE("test context pool") {
   CHECK(pool.size() == 1);
 }
 
+TEST_CASE("test connection placement") {
+  io_context_pool pool(3);
+  CHECK(pool.place_connection() == 0);
+  CHECK(pool.place_connection() == 1);
+
+  pool.set_placement_policy(placement_policy::least_loaded);
+  pool.get_load(0)->connections = 2;
+  pool.get_load(1)->connections = 1;
+  pool.get_load(2)->connections = 1;
+  pool.get_load(1)->requests = 100;
+  CHECK(pool.place_connection() == 2);
+  pool.get_load(2)->connections = 3;
+  CHECK(pool.place_connection() == 0);
+
+  rpc_server server("127.0.0.1:9004", 2);
+  server.set_placement_policy(placement_policy::least_loaded);
+  server.register_handler<add>();
+  server.async_start();
+  rpc_client client1{};
+  rpc_client client2{};
+  for (auto *client : {&client1, &client2}) {
+    auto ec = sync_wait(client->get_executor(),
+                        client->connect("127.0.0.1:9004"));
+    CHECK(!ec);
+    auto r = sync_wait(client->get_executor(), client->call<add>(1, 2));
+    CHECK(r.value == 3);
+  }
+}
+
+#if defined(__linux__)
+TEST_CASE("test cpu affinity") {
+  // the cores this process may run on.
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  REQUIRE(sched_getaffinity(0, sizeof(set), &set) == 0);
+  std::vector<int> allowed;
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &set)) {
+      allowed.push_back(i);
+    }
+  }
+  REQUIRE(!allowed.empty());
+  int core = allowed.back();
+
+  io_context_pool pool(2);
+  pool.set_cpu_affinity({core});
+  std::thread thd([&] { pool.run(); });
+  for (size_t i = 0; i < pool.size(); i++) {
+    auto cpu = asio::post(pool.get_io_context(i),
+                          asio::use_future([] { return sched_getcpu(); }));
+    CHECK(cpu.get() == core);
+  }
+  pool.stop();
+  thd.join();
+  CHECK(!rest_rpc::detail::bind_to_cpu(-1));
+  CHECK(!rest_rpc::detail::bind_to_cpu(CPU_SETSIZE));
+
+  // the running global executor is pinned too, then its threads get back the
+  // original mask, the later tests share them.
+  set_global_cpu_affinity({core});
+  for (unsigned i = 0; i < std::thread::hardware_concurrency(); i++) {
+    auto cpu = asio::post(get_global_executor(),
+                          asio::use_future([] { return sched_getcpu(); }));
+    CHECK(cpu.get() == core);
+  }
+  auto &global_pool = rest_rpc::detail::global_io_context_pool();
+  for (size_t i = 0; i < global_pool.size(); i++) {
+    auto restored = asio::post(global_pool.get_io_context(i),
+                               asio::use_future([&set] {
+                                 return pthread_setaffinity_np(
+                                     pthread_self(), sizeof(set), &set);
+                               }));
+    CHECK(restored.get() == 0);
+  }
+}
+#endif
+
 TEST_CASE("test server start") {
   rpc_server server("127.0.0.1:9005");
   server.register_handler<add>();
@@ -412,6 +556,624 @@ TEST_CASE("test cross ending") {
   CHECK(ret.value == "test");
 }
 
+TEST_CASE("test multiplexing") {
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<echo>();
+  server.register_handler<echo_sv>();
+  server.register_handler<add_coro>();
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  CHECK(!ec);
+
+  constexpr int count = 100;
+  std::atomic<int> ok_count = 0;
+  std::atomic<int> finished = 0;
+  std::promise<void> promise;
+  auto call = [&](int i) -> asio::awaitable<void> {
+    auto str = std::to_string(i);
+    auto r1 = co_await client.call<echo>(str);
+    auto r2 = co_await client.call<add_coro>(i, 1);
+    if (r1.ec == rpc_errc::ok && r1.value == str && r2.ec == rpc_errc::ok &&
+        r2.value == i + 1) {
+      ok_count++;
+    }
+    if (++finished == count) {
+      promise.set_value();
+    }
+  };
+  for (int i = 0; i < count; i++) {
+    asio::co_spawn(client.get_executor(), call(i), asio::detached);
+  }
+  promise.get_future().wait();
+  CHECK(ok_count == count);
+
+  auto sub = [&]() -> asio::awaitable<void> {
+    for (int i = 0; i < 3; i++) {
+      auto result = co_await client.subscribe<std::string>("topic1");
+      CHECK(result.ec == rpc_errc::ok);
+      CHECK(result.value == "publish message");
+    }
+  };
+  auto sub_future = async_future(client.get_executor(), sub());
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  for (int i = 0; i < 3; i++) {
+    server.sync_publish("topic1", "publish message");
+  }
+  sub_future.wait();
+
+  // the view is kept alive by the result.
+  auto view = sync_wait(client.get_executor(), client.call<echo_sv>("view"));
+  for (int i = 0; i < 100; i++) {
+    sync_wait(client.get_executor(), client.call<echo>(std::to_string(i)));
+  }
+  CHECK(view.value == "view");
+
+  // a topic has one waiter.
+  auto first = async_future(client.get_executor(),
+                            client.subscribe<std::string>("topic2"));
+  while (server.subscriber_count("topic2") == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  auto second = sync_wait(client.get_executor(),
+                          client.subscribe<std::string>("topic2"));
+  CHECK(second.ec == rpc_errc::duplicate_topic);
+  server.sync_publish("topic2", "publish message");
+  CHECK(first.get().value == "publish message");
+
+  // the topics are subscribed again after reconnecting.
+  ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  REQUIRE(!ec);
+  while (server.subscriber_count("topic1") != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  auto resub = async_future(client.get_executor(),
+                            client.subscribe<std::string>("topic1"));
+  while (server.subscriber_count("topic1") == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  server.sync_publish("topic1", "again");
+  CHECK(resub.get().value == "again");
+
+  server.stop();
+  auto result = sync_wait(client.get_executor(), client.call<echo>("test"));
+  CHECK(result.ec != rpc_errc::ok);
+}
+
+asio::awaitable<int> slow_add(int a, int b) {
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  timer.expires_after(std::chrono::milliseconds(200));
+  co_await timer.async_wait(asio::use_awaitable);
+  co_return a + b;
+}
+
+std::thread::id io_thread_id;
+std::thread::id offload_thread_id;
+
+void record_io_thread() { io_thread_id = std::this_thread::get_id(); }
+
+int heavy_add(int a, int b) {
+  offload_thread_id = std::this_thread::get_id();
+  CHECK(get_context().get_conn() != nullptr);
+  return a + b;
+}
+
+TEST_CASE("test offload handler") {
+  rpc_server server("127.0.0.1:9004", 1);
+  server.set_offload_threads(2);
+  server.register_handler<record_io_thread>();
+  server.register_offload_handler<heavy_add>();
+  server.async_start();
+
+  rpc_client client{};
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  CHECK(!ec);
+  auto r = sync_wait(client.get_executor(), client.call<record_io_thread>());
+  CHECK(r.ec == rpc_errc::ok);
+  auto r1 = sync_wait(client.get_executor(), client.call<heavy_add>(1, 2));
+  CHECK(r1.value == 3);
+  CHECK(offload_thread_id != std::thread::id{});
+  CHECK(offload_thread_id != io_thread_id);
+}
+
+TEST_CASE("test concurrent requests") {
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<echo>();
+  server.register_handler<slow_add>();
+  server.register_handler<delay_response2>();
+  server.set_max_concurrent_requests(4);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  CHECK(!ec);
+
+  std::vector<std::string> finished;
+  std::promise<void> promise;
+  auto slow = [&]() -> asio::awaitable<void> {
+    auto r = co_await client.call<slow_add>(1, 2);
+    CHECK(r.value == 3);
+    finished.push_back("slow");
+    if (finished.size() == 3) {
+      promise.set_value();
+    }
+  };
+  auto fast = [&]() -> asio::awaitable<void> {
+    auto r = co_await client.call<echo>("fast");
+    CHECK(r.value == "fast");
+    finished.push_back(r.value);
+    auto r1 = co_await client.call<delay_response2>("delay");
+    CHECK(r1.value == "delay");
+    finished.push_back(r1.value);
+    if (finished.size() == 3) {
+      promise.set_value();
+    }
+  };
+  asio::co_spawn(client.get_executor(), slow(), asio::detached);
+  asio::co_spawn(client.get_executor(), fast(), asio::detached);
+  promise.get_future().wait();
+  // the slow request doesn't block the others on the same connection.
+  CHECK(finished.back() == "slow");
+
+  std::atomic<int> count = 0;
+  std::promise<void> promise1;
+  auto call = [&](int i) -> asio::awaitable<void> {
+    auto r = co_await client.call<slow_add>(i, 1);
+    CHECK(r.value == i + 1);
+    if (++count == 10) {
+      promise1.set_value();
+    }
+  };
+  for (int i = 0; i < 10; i++) {
+    asio::co_spawn(client.get_executor(), call(i), asio::detached);
+  }
+  promise1.get_future().wait();
+}
+
+std::promise<bool> cancelled_promise;
+
+asio::awaitable<int> cancellable_add(int a, int b) {
+  auto req = get_context().request();
+  asio::steady_timer timer(co_await asio::this_coro::executor);
+  timer.expires_after(std::chrono::milliseconds(300));
+  co_await timer.async_wait(asio::use_awaitable);
+  cancelled_promise.set_value(
+      req->cancelled.load(std::memory_order::acquire));
+  co_return a + b;
+}
+
+TEST_CASE("test cancel on timeout") {
+  rpc_server server("127.0.0.1:9004", 1);
+  server.register_handler<echo>();
+  server.register_handler<cancellable_add>();
+  server.set_max_concurrent_requests(4);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  client.enable_cancel_on_timeout(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  REQUIRE(!ec);
+
+  cancelled_promise = {};
+  auto r = sync_wait(client.get_executor(),
+                     client.call_for<cancellable_add>(
+                         std::chrono::milliseconds(50), 1, 2));
+  CHECK(r.ec == rpc_errc::request_timeout);
+  // the connection is kept, the late reply is not taken by the next call.
+  CHECK(!client.has_closed());
+  auto r1 = sync_wait(client.get_executor(), client.call<echo>("hello"));
+  CHECK(r1.value == "hello");
+  CHECK(cancelled_promise.get_future().get());
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  r1 = sync_wait(client.get_executor(), client.call<echo>("world"));
+  CHECK(r1.value == "world");
+  CHECK(server.connection_count() == 1);
+
+  // cancelled by the canceller before the timeout.
+  cancelled_promise = {};
+  call_canceller canceller;
+  auto cancel_call = [&]() -> asio::awaitable<rpc_errc> {
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    timer.expires_after(std::chrono::milliseconds(20));
+    timer.async_wait([&](std::error_code) { canceller.cancel(); });
+    auto r = co_await client.cancellable_call_for<cancellable_add>(
+        canceller, std::chrono::seconds(5), 1, 2);
+    co_return r.ec;
+  };
+  CHECK(sync_wait(client.get_executor(), cancel_call()) ==
+        rpc_errc::request_cancelled);
+  CHECK(cancelled_promise.get_future().get());
+  CHECK(!client.has_closed());
+}
+
+TEST_CASE("test call deadlines") {
+  rpc_server server("127.0.0.1:9004", 1);
+  server.register_handler<echo>();
+  server.register_handler<slow_add>();
+  server.set_max_concurrent_requests(4);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  REQUIRE(!ec);
+
+  // a shorter deadline scheduled after a longer one still expires first.
+  std::promise<rpc_errc> long_promise;
+  auto long_call = [&]() -> asio::awaitable<void> {
+    auto r = co_await client.call_for<slow_add>(std::chrono::seconds(5), 1, 2);
+    long_promise.set_value(r.ec);
+  };
+  asio::co_spawn(client.get_executor(), long_call(), asio::detached);
+  auto start = std::chrono::steady_clock::now();
+  auto r = sync_wait(client.get_executor(),
+                     client.call_for<slow_add>(std::chrono::milliseconds(50),
+                                               1, 2));
+  CHECK(r.ec == rpc_errc::request_timeout);
+  CHECK(std::chrono::steady_clock::now() - start <
+        std::chrono::milliseconds(150));
+  CHECK(long_promise.get_future().get() == rpc_errc::ok);
+
+  // the deadlines of the finished calls don't pile up.
+  for (int i = 0; i < 500; i++) {
+    auto r1 = sync_wait(client.get_executor(),
+                        client.call_for<echo>(std::chrono::seconds(5), "a"));
+    CHECK(r1.value == "a");
+  }
+  CHECK(!client.has_closed());
+
+  // without multiplexing the timed out connection is closed.
+  rpc_client client1{};
+  ec = sync_wait(client1.get_executor(), client1.connect("127.0.0.1:9004"));
+  REQUIRE(!ec);
+  auto r2 = sync_wait(client1.get_executor(),
+                      client1.call_for<slow_add>(
+                          std::chrono::milliseconds(50), 1, 2));
+  CHECK(r2.ec == rpc_errc::request_timeout);
+  CHECK(client1.has_closed());
+}
+
+TEST_CASE("test deadline of a queued request") {
+  // a peer which never reads, so the writes get stuck.
+  asio::io_context io_ctx;
+  asio::ip::tcp::acceptor acceptor(
+      io_ctx, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                      9010));
+  std::promise<void> done;
+  auto peer = std::async(std::launch::async, [&] {
+    auto socket = acceptor.accept();
+    done.get_future().wait();
+  });
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9010"));
+  REQUIRE(!ec);
+
+  // much more than the socket buffers, it is still being written.
+  std::promise<rpc_errc> big_promise;
+  auto big_call = [&]() -> asio::awaitable<void> {
+    auto r = co_await client.call_for<echo>(std::chrono::milliseconds(500),
+                                            std::string(16 * 1024 * 1024, 'a'));
+    big_promise.set_value(r.ec);
+  };
+  asio::co_spawn(client.get_executor(), big_call(), asio::detached);
+
+  // the queued request is dropped, the connection is kept.
+  auto r = sync_wait(client.get_executor(),
+                     client.call_for<echo>(std::chrono::milliseconds(50), "a"));
+  CHECK(r.ec == rpc_errc::request_timeout);
+  CHECK(!client.has_closed());
+
+  // the request in the write in progress can't be taken back.
+  CHECK(big_promise.get_future().get() == rpc_errc::request_timeout);
+  CHECK(client.has_closed());
+  done.set_value();
+  peer.get();
+}
+
+TEST_CASE("test request dropped in the middle of the queue") {
+  // a peer which starts reading when it is told to, then collects the bodies
+  // of the frames it has got.
+  asio::io_context io_ctx;
+  asio::ip::tcp::acceptor acceptor(
+      io_ctx, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                      9011));
+  std::promise<void> start_reading;
+  auto peer = std::async(std::launch::async, [&] {
+    auto socket = acceptor.accept();
+    start_reading.get_future().wait();
+    std::vector<std::string> bodies;
+    while (bodies.size() < 6) {
+      rest_rpc_header header{};
+      asio::read(socket, asio::buffer(&header, sizeof(header)));
+      std::string body(header.body_len + header.attach_length, '\0');
+      asio::read(socket, asio::buffer(body));
+      bodies.push_back(std::move(body));
+    }
+    return bodies;
+  });
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9011"));
+  REQUIRE(!ec);
+
+  // the big request and the one after it are being written, the others are
+  // queued behind them, the dropped one is in the front half of the queue.
+  std::string big(16 * 1024 * 1024, 'a');
+  std::vector<std::string> bodies{"w", big, "y", "x", "b", "c", "d"};
+  constexpr size_t dropped = 3;
+  std::vector<std::promise<rpc_errc>> promises(bodies.size());
+  auto call = [&](size_t i) -> asio::awaitable<void> {
+    auto timeout = i == dropped ? std::chrono::milliseconds(50)
+                                : std::chrono::milliseconds(5000);
+    auto r = co_await client.call_for<echo>(timeout, bodies[i]);
+    promises[i].set_value(r.ec);
+  };
+  auto executor = client.get_executor();
+  // spawned together, so the two after the first one are written together.
+  asio::post(executor, [&] {
+    for (size_t i = 0; i < dropped; i++) {
+      asio::co_spawn(executor, call(i), asio::detached);
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  for (size_t i = dropped; i < bodies.size(); i++) {
+    asio::co_spawn(executor, call(i), asio::detached);
+  }
+
+  // the frames around the dropped one are written as they are.
+  CHECK(promises[dropped].get_future().get() == rpc_errc::request_timeout);
+  CHECK(!client.has_closed());
+  start_reading.set_value();
+  // a broken stream leaves the peer waiting for the rest of a frame.
+  bool read_all =
+      peer.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+  // the peer never replies.
+  client.close();
+  REQUIRE(read_all);
+  auto written = bodies;
+  written.erase(written.begin() + dropped);
+  CHECK(peer.get() == written);
+  for (size_t i = 0; i < bodies.size(); i++) {
+    if (i != dropped) {
+      CHECK(promises[i].get_future().get() != rpc_errc::ok);
+    }
+  }
+}
+
+TEST_CASE("test send queue") {
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<echo>();
+  server.set_max_concurrent_requests(16);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  CHECK(!ec);
+
+  // the responses written by the concurrent handlers are gathered by the
+  // send queue, the large ones make the writes overlap.
+  constexpr int count = 200;
+  std::atomic<int> ok_count = 0;
+  std::atomic<int> finished = 0;
+  std::promise<void> promise;
+  auto call = [&](int i) -> asio::awaitable<void> {
+    std::string str(i % 2 == 0 ? 64 * 1024 : 16, 'a' + i % 26);
+    auto r = co_await client.call<echo>(str);
+    if (r.ec == rpc_errc::ok && r.value == str) {
+      ok_count++;
+    }
+    if (++finished == count) {
+      promise.set_value();
+    }
+  };
+  for (int i = 0; i < count; i++) {
+    asio::co_spawn(client.get_executor(), call(i), asio::detached);
+  }
+  promise.get_future().wait();
+  CHECK(ok_count == count);
+}
+
+TEST_CASE("test pipelined frames") {
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<echo>();
+  server.async_start();
+
+  asio::io_context io_ctx;
+  tcp_socket socket(io_ctx);
+  socket.connect(asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                         9004));
+
+  auto make_frame = [](std::string_view body, uint64_t seq_num) {
+    rest_rpc_header header{};
+    header.function_id = get_key<echo>();
+    header.seq_num = seq_num;
+    header.body_len = body.size();
+    std::string frame((const char *)&header, sizeof(header));
+    frame.append(body);
+    return frame;
+  };
+
+  // several frames arrive in one read, the last one is split into two reads.
+  std::string frames;
+  std::vector<std::string> bodies{"a", "bb", "ccc", "dddd"};
+  for (size_t i = 0; i < bodies.size(); i++) {
+    frames.append(make_frame(bodies[i], i + 1));
+  }
+  size_t half = frames.size() - 3;
+  asio::write(socket, asio::buffer(frames.data(), half));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  asio::write(socket, asio::buffer(frames.data() + half, frames.size() - half));
+
+  for (size_t i = 0; i < bodies.size(); i++) {
+    rest_rpc_header header;
+    asio::read(socket, asio::buffer(&header, sizeof(header)));
+    CHECK(header.seq_num == i + 1);
+    std::string body(header.body_len, '\0');
+    asio::read(socket, asio::buffer(body));
+    CHECK(body[0] == (char)rpc_errc::ok);
+    CHECK(body.substr(1) == bodies[i]);
+  }
+
+  // the lengths whose sum overflows are a protocol error.
+  rest_rpc_header header{};
+  header.function_id = get_key<echo>();
+  header.body_len = UINT64_MAX - 8;
+  header.attach_length = 16;
+  std::string frame((const char *)&header, sizeof(header));
+  frame.append(16, 'x');
+  asio::write(socket, asio::buffer(frame));
+  std::error_code ec;
+  char c;
+  asio::read(socket, asio::buffer(&c, 1), ec);
+  CHECK(ec == asio::error::eof);
+
+  // a frame longer than the limit is rejected before it is allocated.
+  tcp_socket socket1(io_ctx);
+  socket1.connect(asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                          9004));
+  header.body_len = uint64_t(8) << 30;
+  header.attach_length = 0;
+  asio::write(socket1, asio::buffer(&header, sizeof(header)));
+  asio::read(socket1, asio::buffer(&c, 1), ec);
+  CHECK(ec == asio::error::eof);
+
+  // the server survives.
+  rpc_client client{};
+  ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+  REQUIRE(!ec);
+  auto r = sync_wait(client.get_executor(), client.call<echo>("hello"));
+  CHECK(r.value == "hello");
+
+  // and so does the client for a response longer than its limit.
+  client.set_max_frame_length(16);
+  r = sync_wait(client.get_executor(), client.call<echo>(std::string(64, 'a')));
+  CHECK(r.ec == rpc_errc::protocol_error);
+  CHECK(client.has_closed());
+}
+
+size_t attachment_size(int n) {
+  auto attachment = get_context().request_attachment();
+  std::string resp(attachment);
+  resp.append(std::to_string(n));
+  get_context().set_response_attachment(std::move(resp));
+  return attachment.size();
+}
+
+TEST_CASE("test attachment") {
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<attachment_size>();
+  server.register_handler<echo>();
+  server.async_start();
+
+  std::string blob(1024 * 1024, 'x');
+  std::string tail = "tail";
+  auto test_client = [&](rpc_client &client) {
+    auto ec =
+        sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+    CHECK(!ec);
+
+    auto r = sync_wait(client.get_executor(),
+                       client.call_with_attachment<attachment_size>(
+                           {blob, tail}, 42));
+    CHECK(r.ec == rpc_errc::ok);
+    CHECK(r.value == blob.size() + tail.size());
+    CHECK(r.attachment.size() == blob.size() + tail.size() + 2);
+    CHECK(r.attachment.starts_with(blob));
+    CHECK(r.attachment.ends_with("tail42"));
+
+    // the response attachment is skipped by the call without attachment.
+    auto r1 =
+        sync_wait(client.get_executor(), client.call<attachment_size>(1));
+    CHECK(r1.ec == rpc_errc::ok);
+    CHECK(r1.value == 0);
+    auto r2 = sync_wait(client.get_executor(), client.call<echo>("test"));
+    CHECK(r2.value == "test");
+  };
+
+  rpc_client client{};
+  test_client(client);
+
+  rpc_client mux_client{};
+  mux_client.enable_multiplexing(true);
+  test_client(mux_client);
+}
+
+double half(double d) { return d / 2; }
+
+TEST_CASE("test serialize type") {
+  auto buf = rpc_codec::pack_args<serialize_type::binary>(0x01020304);
+  CHECK(buf.data() == std::string_view("\x04\x03\x02\x01", 4));
+  CHECK(rpc_codec::unpack<int, serialize_type::binary>(buf.data()) ==
+        0x01020304);
+  // the arithmetic values are packed in place without std::string.
+  auto id = rpc_codec::pack_as(serialize_type::binary, int64_t(-1));
+  CHECK(id.buf.empty());
+  CHECK(id.size() == sizeof(int64_t));
+  CHECK(rpc_codec::unpack_as<int64_t>(serialize_type::binary, id.data()) ==
+        -1);
+  CHECK_THROWS(rpc_codec::unpack<int, serialize_type::binary>("12"));
+  CHECK(rpc_codec::unpack_as<int>(serialize_type::rest, "12") == 12);
+  CHECK_THROWS(rpc_codec::pack_as(serialize_type::user, 1));
+
+  rpc_server server("127.0.0.1:9004");
+  server.register_handler<add>();
+  server.register_handler<echo>();
+  server.register_handler<half>();
+  server.register_handler<get_person>();
+  server.register_handler<modify_person>();
+  server.register_handler<delay_response3>();
+  server.async_start();
+
+  auto test_client = [&](rpc_client &client, serialize_type type) {
+    client.set_serialize_type(type);
+    auto ec =
+        sync_wait(client.get_executor(), client.connect("127.0.0.1:9004"));
+    CHECK(!ec);
+
+    auto r = sync_wait(client.get_executor(), client.call<add>(1, 2));
+    CHECK(r.ec == rpc_errc::ok);
+    CHECK(r.value == 3);
+    auto r1 = sync_wait(client.get_executor(), client.call<half>(3.0));
+    CHECK(r1.value == 1.5);
+    auto r2 = sync_wait(client.get_executor(), client.call<echo>("test"));
+    CHECK(r2.value == "test");
+    person p{1, "tom", 20};
+    auto r3 = sync_wait(client.get_executor(),
+                        client.call<modify_person>(p, "jack"));
+    CHECK(r3.value.name == "jack");
+    CHECK(r3.value.age == 20);
+    auto r4 = sync_wait(client.get_executor(), client.call<get_person>(p));
+    CHECK(r4.value.name == "tom");
+    // the delayed response is packed by the codec of the request.
+    auto r5 =
+        sync_wait(client.get_executor(), client.call<delay_response3>("hi"));
+    CHECK(r5.value == "hi");
+
+    // no user codec for these types.
+    client.set_serialize_type(serialize_type::user);
+    auto r6 = sync_wait(client.get_executor(), client.call<add>(1, 2));
+    CHECK(r6.ec == rpc_errc::invalid_argument);
+  };
+
+  for (auto type : {serialize_type::rest, serialize_type::struct_pack,
+                    serialize_type::binary}) {
+    rpc_client client{};
+    test_client(client, type);
+
+    rpc_client mux_client{};
+    mux_client.enable_multiplexing(true);
+    test_client(mux_client, type);
+  }
+}
+
 TEST_CASE("test pub sub") {
   rpc_server server("127.0.0.1:9004");
   server.async_start();
@@ -473,6 +1235,583 @@ TEST_CASE("test sync pub sub") {
   promise.get_future().wait();
 }
 
+TEST_CASE("test client pool") {
+  rpc_server server("127.0.0.1:9004", 2);
+  server.register_handler<echo>();
+  server.async_start();
+
+  client_pool_config config{};
+  config.max_connections = 2;
+  config.wait_timeout = std::chrono::milliseconds(200);
+  config.check_interval = std::chrono::milliseconds(50);
+  // without multiplexing the idle connections are probed.
+  SUBCASE("multiplexing") { config.enable_multiplexing = true; }
+  SUBCASE("one call at a time") { config.enable_multiplexing = false; }
+  rpc_client_pool pool(config);
+  std::string address = "127.0.0.1:9004";
+
+  auto get = [&] {
+    return sync_wait(get_global_executor(), pool.get(address));
+  };
+
+  auto c1 = get();
+  auto c2 = get();
+  REQUIRE(c1 != nullptr);
+  REQUIRE(c2 != nullptr);
+  CHECK(pool.connection_count(address) == 2);
+  auto r = sync_wait(c1->get_executor(), c1->call<echo>("hello"));
+  CHECK(r.value == "hello");
+
+  // the endpoint is full.
+  CHECK(get() == nullptr);
+
+  // the waiter gets the returned connection.
+  auto future = async_future(get_global_executor(), pool.get(address));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  auto raw = c1.get();
+  c1.reset();
+  auto c3 = future.get();
+  CHECK(c3.get() == raw);
+  CHECK(pool.connection_count(address) == 2);
+
+  // a closed connection is dropped when it is returned.
+  c2->close();
+  for (int i = 0; i < 100 && !c2->has_closed(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  c2.reset();
+  CHECK(pool.connection_count(address) == 1);
+
+  // the idle connection closed by the server is reconnected, the server
+  // settles on one new connection.
+  c3.reset();
+  CHECK(pool.connection_count(address) == 1);
+  for (int i = 0; i < 200 && server.connection_count() != 1; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  auto conns = server.get_connections();
+  REQUIRE(conns.size() == 1);
+  uint64_t closed_id = conns.begin()->first;
+  conns.begin()->second->close();
+  conns.clear();
+  auto reconnected = [&] {
+    auto conns = server.get_connections();
+    return conns.size() == 1 && !conns.contains(closed_id);
+  };
+  for (int i = 0; i < 200 && !reconnected(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  CHECK(reconnected());
+  CHECK(pool.connection_count(address) == 1);
+  auto c4 = get();
+  REQUIRE(c4 != nullptr);
+  r = sync_wait(c4->get_executor(), c4->call<echo>("world"));
+  CHECK(r.value == "world");
+}
+
+TEST_CASE("test balanced client") {
+  std::atomic<int> fast_calls = 0;
+  std::atomic<int> slow_calls = 0;
+  rpc_server fast("127.0.0.1:9004", 1);
+  fast.register_handler(get_func_name<echo>(), [&](std::string str) {
+    fast_calls++;
+    return str;
+  });
+  fast.async_start();
+  rpc_server slow("127.0.0.1:9005", 1);
+  slow.register_handler(get_func_name<echo>(), [&](std::string str) {
+    slow_calls++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return str;
+  });
+  slow.async_start();
+
+  auto run = [&](balance_policy policy, int count) {
+    fast_calls = 0;
+    slow_calls = 0;
+    balanced_client client(policy);
+    auto ec = sync_wait(client.get_executor(),
+                        client.connect(std::vector<std::string>{
+                            "127.0.0.1:9004", "127.0.0.1:9005"}));
+    REQUIRE(!ec);
+    REQUIRE(client.size() == 2);
+    auto calls = [&]() -> asio::awaitable<void> {
+      for (int i = 0; i < count; i++) {
+        auto r = co_await client.call<echo>("hello");
+        CHECK(r.value == "hello");
+      }
+    };
+    sync_wait(client.get_executor(), calls());
+    CHECK(fast_calls + slow_calls == count);
+    CHECK(client.outstanding(0) == 0);
+  };
+
+  SUBCASE("round robin") {
+    run(balance_policy::round_robin, 20);
+    CHECK(fast_calls == 10);
+    CHECK(slow_calls == 10);
+  }
+  SUBCASE("least outstanding") {
+    run(balance_policy::least_outstanding, 20);
+    CHECK(fast_calls > 0);
+    CHECK(slow_calls > 0);
+  }
+  SUBCASE("power of two") {
+    // the slow endpoint is only tried until its latency is known.
+    run(balance_policy::power_of_two, 50);
+    CHECK(fast_calls > slow_calls);
+  }
+  SUBCASE("closed endpoint") {
+    balanced_client client;
+    auto ec = sync_wait(client.get_executor(),
+                        client.connect(std::vector<std::string>{
+                            "127.0.0.1:9004", "127.0.0.1:9006"}));
+    REQUIRE(!ec);
+    CHECK(client.size() == 1);
+    client.close();
+    auto r = sync_wait(client.get_executor(), client.call<echo>("hello"));
+    CHECK(r.ec == rpc_errc::socket_closed);
+  }
+  SUBCASE("failed call") {
+    balanced_client client(balance_policy::power_of_two);
+    auto ec = sync_wait(client.get_executor(),
+                        client.connect(std::vector<std::string>{
+                            "127.0.0.1:9005"}));
+    REQUIRE(!ec);
+    // observed as a timeout.
+    auto r = sync_wait(client.get_executor(),
+                       client.call_for<echo>(std::chrono::milliseconds(2),
+                                             "hello"));
+    CHECK(r.ec == rpc_errc::request_timeout);
+    CHECK(client.latency(0) >= 2000);
+  }
+  SUBCASE("ipv6") {
+    rpc_server server("::1", "9009", 1);
+    server.register_handler<echo>();
+    server.async_start();
+    balanced_client client;
+    auto ec =
+        sync_wait(client.get_executor(), client.connect("::1", "9009"));
+    REQUIRE(!ec);
+    CHECK(client.size() == 1);
+    auto r = sync_wait(client.get_executor(), client.call<echo>("hello"));
+    CHECK(r.value == "hello");
+  }
+}
+
+TEST_CASE("test hedged call") {
+  rpc_server fast("127.0.0.1:9004", 1);
+  fast.register_handler<echo>();
+  fast.async_start();
+  rpc_server slow("127.0.0.1:9005", 1);
+  slow.register_handler(get_func_name<echo>(), [](std::string str) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return str;
+  });
+  slow.async_start();
+
+  balanced_client client(balance_policy::round_robin);
+  client.set_hedge_policy(0.9, std::chrono::milliseconds(20));
+  auto ec = sync_wait(client.get_executor(),
+                      client.connect(std::vector<std::string>{
+                          "127.0.0.1:9004", "127.0.0.1:9005"}));
+  REQUIRE(!ec);
+
+  auto calls = [&]() -> asio::awaitable<void> {
+    for (int i = 0; i < 6; i++) {
+      auto start = std::chrono::steady_clock::now();
+      auto r = co_await client.hedged_call<echo>("hello");
+      CHECK(r.ec == rpc_errc::ok);
+      CHECK(r.value == "hello");
+      // the slow replica is hedged by the fast one.
+      CHECK(std::chrono::steady_clock::now() - start <
+            std::chrono::milliseconds(150));
+    }
+  };
+  sync_wait(client.get_executor(), calls());
+  CHECK(client.hedged_requests() >= 3);
+  // the cancelled losers on the slow endpoint only raise its latency.
+  CHECK(client.latency(1) >= 20000);
+
+  // the percentile is clamped, enough calls to refresh it.
+  client.set_hedge_policy(1.5, std::chrono::milliseconds(20));
+  auto more_calls = [&]() -> asio::awaitable<void> {
+    for (int i = 0; i < 16; i++) {
+      auto r = co_await client.hedged_call<echo>("hello");
+      CHECK(r.value == "hello");
+    }
+  };
+  sync_wait(client.get_executor(), more_calls());
+}
+
+TEST_CASE("test subscription stream") {
+  rpc_server server("127.0.0.1:9004", 2);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  sync_wait(get_global_executor(), client.connect("127.0.0.1:9004"));
+
+  constexpr int count = 100;
+  std::promise<void> subscribed;
+  std::promise<std::vector<std::string>> done;
+  auto sub = [&]() -> asio::awaitable<void> {
+    auto stream = client.subscribe_stream<std::string>("topic1");
+    std::vector<std::string> batch;
+    auto ec = co_await stream.next(batch);
+    CHECK(ec == rpc_errc::ok);
+    CHECK(batch == std::vector<std::string>{"start"});
+    subscribed.set_value();
+
+    // the messages received meanwhile are taken in one batch.
+    asio::steady_timer timer(co_await asio::this_coro::executor);
+    timer.expires_after(std::chrono::milliseconds(300));
+    co_await timer.async_wait(asio::use_awaitable);
+
+    std::vector<std::string> all;
+    co_await stream.next(batch);
+    CHECK(batch.size() > 1);
+    all.insert(all.end(), batch.begin(), batch.end());
+    while (all.size() < count) {
+      if (co_await stream.next(batch) != rpc_errc::ok) {
+        break;
+      }
+      all.insert(all.end(), batch.begin(), batch.end());
+    }
+    done.set_value(std::move(all));
+  };
+  asio::co_spawn(client.get_executor(), sub(), asio::detached);
+
+  for (int i = 0; i < 200 && server.subscriber_count("topic1") != 1; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  server.sync_publish("topic1", "start");
+  subscribed.get_future().wait();
+
+  for (int i = 0; i < count; i++) {
+    server.sync_publish("topic1", std::to_string(i));
+  }
+  auto all = done.get_future().get();
+  REQUIRE(all.size() == count);
+  for (int i = 0; i < count; i++) {
+    CHECK(all[i] == std::to_string(i));
+  }
+}
+
+TEST_CASE("test subscription stream error") {
+  asio::io_context io_ctx;
+  asio::ip::tcp::acceptor acceptor(
+      io_ctx, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                      9008));
+  auto publisher = std::async(std::launch::async, [&] {
+    auto socket = acceptor.accept();
+    rest_rpc_header header{};
+    asio::read(socket, asio::buffer(&header, sizeof(header)));
+
+    // two messages, an error and another message in one write.
+    std::string frames;
+    auto append = [&](rpc_errc ec, std::string_view msg) {
+      std::string body(1, char(ec));
+      if (ec == rpc_errc::ok) {
+        body.append(rpc_codec::pack_args(msg));
+      }
+      rest_rpc_header h{};
+      h.magic = 39;
+      h.msg_type = 1;
+      h.function_id = header.function_id;
+      h.body_len = body.size();
+      frames.append((const char *)&h, sizeof(h)).append(body);
+    };
+    append(rpc_errc::ok, "a");
+    append(rpc_errc::ok, "b");
+    append(rpc_errc::function_exception, "");
+    append(rpc_errc::ok, "c");
+    asio::write(socket, asio::buffer(frames));
+    // keep the connection until the client closes it.
+    asio::error_code ec;
+    asio::read(socket, asio::buffer(&header, sizeof(header)), ec);
+  });
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  auto ec =
+      sync_wait(client.get_executor(), client.connect("127.0.0.1:9008"));
+  REQUIRE(!ec);
+  auto sub = [&]() -> asio::awaitable<void> {
+    auto stream = client.subscribe_stream<std::string>("topic1");
+    std::vector<std::string> batch, all;
+    while (all.size() < 2) {
+      auto ec = co_await stream.next(batch);
+      CHECK(ec == rpc_errc::ok);
+      all.insert(all.end(), batch.begin(), batch.end());
+    }
+    CHECK(all == std::vector<std::string>{"a", "b"});
+    auto ec = co_await stream.next(batch);
+    CHECK(ec == rpc_errc::function_exception);
+    CHECK(batch.empty());
+    ec = co_await stream.next(batch);
+    CHECK(ec == rpc_errc::ok);
+    CHECK(batch == std::vector<std::string>{"c"});
+  };
+  sync_wait(client.get_executor(), sub());
+  client.close();
+  publisher.get();
+}
+
+TEST_CASE("test publish to slow subscriber") {
+  rpc_server server("127.0.0.1:9004", 2);
+  server.async_start();
+
+  // subscribes and never reads.
+  asio::io_context ctx;
+  asio::ip::tcp::socket slow(ctx);
+  slow.connect(asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"),
+                                       9004));
+  rest_rpc_header header{};
+  header.msg_type = 1;
+  header.function_id = MD5::MD5Hash32("topic1", 6);
+  asio::write(slow, asio::buffer(&header, sizeof(header)));
+
+  rpc_client client{};
+  sync_wait(get_global_executor(), client.connect("127.0.0.1:9004"));
+
+  constexpr int count = 32;
+  std::string message(1024 * 1024, 'a');
+  std::promise<int> received;
+  auto sub = [&]() -> asio::awaitable<void> {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+      auto result = co_await client.subscribe<std::string>("topic1");
+      if (result.ec == rpc_errc::ok && result.value == message) {
+        n++;
+      }
+    }
+    received.set_value(n);
+  };
+  asio::co_spawn(client.get_executor(), sub(), asio::detached);
+
+  for (int i = 0; i < 200 && server.subscriber_count("topic1") != 2; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  CHECK(server.subscriber_count("topic1") == 2);
+
+  // the slow subscriber doesn't block the publisher and the others.
+  for (int i = 0; i < count; i++) {
+    server.sync_publish("topic1", message);
+  }
+  auto future = received.get_future();
+  REQUIRE(future.wait_for(std::chrono::seconds(10)) ==
+          std::future_status::ready);
+  CHECK(future.get() == count);
+}
+
+TEST_CASE("test publish queue limit") {
+  auto run = [](overflow_policy policy, bool after_connect = false) {
+    rpc_server server("127.0.0.1:9004", 2);
+    if (!after_connect) {
+      server.set_publish_queue_limit(4, policy);
+    }
+    server.async_start();
+
+    asio::io_context ctx;
+    asio::ip::tcp::socket slow(ctx);
+    slow.connect(asio::ip::tcp::endpoint(
+        asio::ip::make_address("127.0.0.1"), 9004));
+    rest_rpc_header header{};
+    header.msg_type = 1;
+    header.function_id = MD5::MD5Hash32("topic1", 6);
+    asio::write(slow, asio::buffer(&header, sizeof(header)));
+    for (int i = 0; i < 200 && server.subscriber_count("topic1") != 1; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(server.subscriber_count("topic1") == 1);
+    if (after_connect) {
+      // applied to the existing connection.
+      server.set_publish_queue_limit(4, policy);
+    }
+
+    // much more than the socket buffers, the last byte is the index.
+    constexpr int count = 64;
+    for (int i = 0; i < count; i++) {
+      std::string message(1024 * 1024, 'a');
+      message.back() = char(i);
+      server.sync_publish("topic1", message);
+    }
+    for (int i = 0; i < 200 && server.dropped_messages() == 0; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(server.dropped_messages() > 0);
+
+    if (policy == overflow_policy::disconnect) {
+      for (int i = 0; i < 200 && server.connection_count() != 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      CHECK(server.connection_count() == 0);
+      CHECK(server.subscriber_count("topic1") == 0);
+      return;
+    }
+
+    // read what has been queued, the latest message is kept unless it is
+    // the newest one to be dropped.
+    auto reader = std::async(std::launch::async, [&] {
+      int received = 0;
+      char last = 0;
+      std::string body;
+      while (received < count) {
+        rest_rpc_header h{};
+        asio::error_code ec;
+        asio::read(slow, asio::buffer(&h, sizeof(h)), ec);
+        if (ec) {
+          break;
+        }
+        body.resize(h.body_len + h.attach_length);
+        asio::read(slow, asio::buffer(body), ec);
+        if (ec) {
+          break;
+        }
+        received++;
+        last = body.back();
+        if (last == char(count - 1)) {
+          break;
+        }
+      }
+      return std::pair(received, last);
+    });
+    if (reader.wait_for(std::chrono::seconds(2)) !=
+        std::future_status::ready) {
+      asio::error_code ec;
+      slow.shutdown(asio::socket_base::shutdown_both, ec);
+      slow.close(ec);
+    }
+    auto [received, last] = reader.get();
+    CHECK(received < count);
+    CHECK(received + server.dropped_messages() == count);
+    if (policy == overflow_policy::drop_newest) {
+      CHECK(last != char(count - 1));
+    } else {
+      CHECK(last == char(count - 1));
+    }
+  };
+
+  SUBCASE("drop oldest") { run(overflow_policy::drop_oldest); }
+  SUBCASE("drop newest") { run(overflow_policy::drop_newest); }
+  SUBCASE("disconnect") { run(overflow_policy::disconnect); }
+  SUBCASE("conflate") { run(overflow_policy::conflate); }
+  SUBCASE("set after connect") { run(overflow_policy::drop_oldest, true); }
+}
+
+TEST_CASE("test topic index") {
+  rpc_server server("127.0.0.1:9004", 2);
+  server.async_start();
+
+  rpc_client client{};
+  client.enable_multiplexing(true);
+  sync_wait(get_global_executor(), client.connect("127.0.0.1:9004"));
+  rpc_client other{};
+  sync_wait(get_global_executor(), other.connect("127.0.0.1:9004"));
+
+  auto wait_subscribers = [&](std::string_view topic, size_t n) {
+    for (int i = 0; i < 200 && server.subscriber_count(topic) != n; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return server.subscriber_count(topic);
+  };
+
+  std::promise<std::pair<std::string, std::string>> both;
+  std::promise<rpc_errc> unsubscribed;
+  auto sub = [&]() -> asio::awaitable<void> {
+    auto r1 = co_await client.subscribe<std::string>("topic1");
+    auto r2 = co_await client.subscribe<std::string>("topic2");
+    both.set_value({r1.value, r2.value});
+    // woken up by unsubscribe.
+    auto r3 = co_await client.subscribe<std::string>("topic2");
+    unsubscribed.set_value(r3.ec);
+  };
+  asio::co_spawn(client.get_executor(), sub(), asio::detached);
+
+  std::promise<std::string> other_msg;
+  auto other_sub = [&]() -> asio::awaitable<void> {
+    auto r = co_await other.subscribe<std::string>("topic1");
+    other_msg.set_value(r.value);
+  };
+  asio::co_spawn(other.get_executor(), other_sub(), asio::detached);
+
+  CHECK(wait_subscribers("topic1", 2) == 2);
+  CHECK(server.subscriber_count("topic3") == 0);
+  server.sync_publish("topic1", "message1");
+  CHECK(other_msg.get_future().get() == "message1");
+
+  // topic2 is subscribed once the first message has been received.
+  CHECK(wait_subscribers("topic2", 1) == 1);
+  server.sync_publish("topic2", "message2");
+  auto [m1, m2] = both.get_future().get();
+  CHECK(m1 == "message1");
+  CHECK(m2 == "message2");
+
+  auto ec = sync_wait(client.get_executor(), client.unsubscribe("topic2"));
+  CHECK(ec == rpc_errc::ok);
+  CHECK(unsubscribed.get_future().get() == rpc_errc::unsubscribed);
+  CHECK(wait_subscribers("topic2", 0) == 0);
+  CHECK(server.subscriber_count("topic1") == 2);
+
+  // without multiplexing the waiter is released when the connection closes.
+  std::promise<rpc_errc> other_unsubscribed;
+  auto other_wait = [&]() -> asio::awaitable<void> {
+    auto r = co_await other.subscribe<std::string>("topic3");
+    other_unsubscribed.set_value(r.ec);
+  };
+  asio::co_spawn(other.get_executor(), other_wait(), asio::detached);
+  CHECK(wait_subscribers("topic3", 1) == 1);
+  ec = sync_wait(other.get_executor(), other.unsubscribe("topic3"));
+  CHECK(ec == rpc_errc::ok);
+  CHECK(wait_subscribers("topic3", 0) == 0);
+  other.close();
+  CHECK(other_unsubscribed.get_future().get() == rpc_errc::unsubscribed);
+
+  // the topics of a closed connection are removed.
+  CHECK(wait_subscribers("topic1", 1) == 1);
+}
+
+TEST_CASE("test idle connection") {
+  rpc_server server("127.0.0.1:9005", 2);
+  server.register_handler<add>();
+  server.set_check_conn_interval(std::chrono::milliseconds(50));
+  server.set_conn_max_age(std::chrono::milliseconds(300));
+  server.async_start();
+
+  rpc_client client{};
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9005"));
+  CHECK(!ec);
+  // the active connection is kept.
+  for (int i = 0; i < 8; i++) {
+    auto r = sync_wait(client.get_executor(), client.call<add>(1, 2));
+    CHECK(r.value == 3);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  CHECK(server.connection_count() == 1);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  CHECK(server.connection_count() == 0);
+}
+
+TEST_CASE("test idle check set after start") {
+  rpc_server server("127.0.0.1:9005", 2);
+  server.register_handler<add>();
+  server.async_start();
+  server.set_conn_max_age(std::chrono::milliseconds(300));
+  server.set_check_conn_interval(std::chrono::milliseconds(50));
+
+  rpc_client client{};
+  auto ec = sync_wait(client.get_executor(), client.connect("127.0.0.1:9005"));
+  CHECK(!ec);
+  auto r = sync_wait(client.get_executor(), client.call<add>(1, 2));
+  CHECK(r.value == 3);
+  CHECK(server.connection_count() == 1);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(800));
+  CHECK(server.connection_count() == 0);
+}
+
 TEST_CASE("test reconnect") {
   rpc_server server("127.0.0.1:9004");
   server.async_start();
@@ -487,6 +1826,10 @@ TEST_CASE("test reconnect") {
   ec = sync_wait(get_global_executor(), client.connect("127.0.0.1:9005"));
   CHECK(!ec);
 
+  // the connection is registered by the acceptor asynchronously.
+  for (int i = 0; i < 100 && server1.connection_count() == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
   CHECK(server1.connection_count() == 1);
   std::this_thread::sleep_for(std::chrono::milliseconds(600));
   // expired connection has been removed.
@@ -535,6 +1878,32 @@ TEST_CASE("test server address") {
   thd2.join();
   thd.join();
 }
+TEST_CASE("test reuse port") {
+  rpc_server server("127.0.0.1:9004", 4);
+  server.enable_reuse_port(true);
+  server.register_handler<add>();
+  auto ec = server.async_start();
+  CHECK(!ec);
+
+  std::vector<std::unique_ptr<rpc_client>> clients;
+  for (int i = 0; i < 8; i++) {
+    auto client = std::make_unique<rpc_client>();
+    auto conn_ec = sync_wait(client->get_executor(),
+                             client->connect("127.0.0.1:9004"));
+    CHECK(!conn_ec);
+    auto r = sync_wait(client->get_executor(), client->call<add>(1, i));
+    CHECK(r.value == 1 + i);
+    clients.push_back(std::move(client));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK(server.connection_count() == clients.size());
+  size_t count = 0;
+  server.for_each_connection([&count](auto &) { count++; });
+  CHECK(count == clients.size());
+  CHECK(server.get_connections().size() == clients.size());
+  server.stop();
+}
+
 TEST_CASE("test wrong client address") {
   rpc_client client{};
   auto ec0 = sync_wait(get_global_executor(), client.connect("127.0.0.1"));